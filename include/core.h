@@ -26,6 +26,31 @@ ErrorCode EndQuery        (QueryID query_id);
 ErrorCode MatchDocument   (DocID doc_id, const char* doc_str);
 ErrorCode GetNextAvailRes (DocID* p_doc_id, unsigned int* p_num_res, QueryID** p_query_ids);
 
+/* Extensions: delivering many results per call */
+typedef struct {
+    DocID           doc_id;
+    unsigned int    num_res;
+    QueryID*        query_ids;      /* Points into the id buffer given to GetAvailResults */
+} DocResult;
+
+/* Called once per matched document. The ids are only valid during the call. */
+typedef void (*ResultCallback)(DocID doc_id, unsigned int num_res, const QueryID* query_ids, void* arg);
+
+/* Deliver the documents in MatchDocument order (1) or as they finish (0, the default). Call before the first document. */
+ErrorCode SetResultOrder    (int in_order);
+/* Deliver every result to `callback` instead of GetNextAvailRes. Call before the first document.
+ * The callback runs on a worker thread while the delivery lock is held, so the workers wait for each
+ * other behind it: keep it short, and never call back into this library from it. */
+ErrorCode SetResultCallback (ResultCallback callback, void* arg);
+/* Waits for results, then moves up to `max_docs` of them to `p_docs`, their ids packed into `query_ids`. */
+ErrorCode GetAvailResults   (DocResult* p_docs, unsigned int max_docs, QueryID* query_ids, unsigned int max_ids, unsigned int* p_num_docs);
+
+/* Extensions: snapshots of the index */
+/* Waits for the submitted documents to be matched, then writes the words, queries and cached distances to `path`. */
+ErrorCode SaveIndex         (const char* path);
+/* Restores a snapshot written by SaveIndex. Only right after InitializeIndex, with the same SIGMOD_EDIT_ENGINE. */
+ErrorCode LoadIndex         (const char* path);
+
 #ifdef __cplusplus
 }
 #endif
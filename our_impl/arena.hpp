@@ -0,0 +1,66 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+/**
+ * Growable array of PODs, addressed by 32-bit index and made of fixed
+ * size chunks. Chunks are never moved, so an element stays where it is
+ * for as long as the arena lives, and readers may keep indexing it while
+ * other threads append. Allocation is lock free. Chunks are zero filled.
+ */
+template <typename T, unsigned CHUNK_BITS=16>
+class Arena
+{
+    static const unsigned CHUNK_SIZE = 1u << CHUNK_BITS;
+    static const unsigned MAX_CHUNKS = 1u << 16;
+
+    T*          chunks[MAX_CHUNKS];
+    unsigned    numChunks;
+    unsigned    mSize;
+
+    /** Installs chunk `c`, unless another thread has done it already. */
+    void ensure (unsigned c) {
+        if (__atomic_load_n(&chunks[c], __ATOMIC_ACQUIRE)) return;
+        T *chunk = new T[CHUNK_SIZE](), *expected = NULL;
+        if (__atomic_compare_exchange_n(&chunks[c], &expected, chunk, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            __atomic_add_fetch(&numChunks, 1, __ATOMIC_RELAXED);
+        else delete[] chunk;
+    }
+
+public:
+    Arena () : numChunks(0), mSize(0) { for (unsigned c=0 ; c<MAX_CHUNKS ; c++) chunks[c] = NULL; }
+
+    ~Arena () { clear(); }
+
+    T& operator[] (unsigned i) const { return chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE-1)]; }
+
+    /**
+     * Reserves `n` consecutive elements (at most CHUNK_SIZE), which never
+     * span two chunks, and returns the index of the first one.
+     */
+    unsigned alloc (unsigned n) {
+        unsigned first, cur = __atomic_load_n(&mSize, __ATOMIC_RELAXED);
+        do {
+            first = cur;
+            if ((first & (CHUNK_SIZE-1)) + n > CHUNK_SIZE) first = (first | (CHUNK_SIZE-1)) + 1;
+        } while (!__atomic_compare_exchange_n(&mSize, &cur, first+n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        ensure(first >> CHUNK_BITS);
+        return first;
+    }
+
+    unsigned size () const { return __atomic_load_n(&mSize, __ATOMIC_RELAXED); }
+
+    unsigned long memory () const { return (unsigned long) numChunks * CHUNK_SIZE * sizeof(T); }
+
+    /** Not to be called while anyone else uses the arena. */
+    void clear () {
+        for (unsigned c=0 ; c<MAX_CHUNKS ; c++) {
+            delete[] chunks[c];
+            chunks[c] = NULL;
+        }
+        numChunks = 0;
+        mSize = 0;
+    }
+
+};
+
+#endif
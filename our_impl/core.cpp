@@ -3,96 +3,231 @@
 #include <cstring>
 #include <cmath>
 #include <pthread.h>
+#include <ctime>
 #include <utility>
 #include <algorithm>
 #include <unordered_map>
 #include <queue>
+#include <deque>
 #include <map>
 #include <list>
 #include <set>
 
-#define NUM_THREADS  24
+#define ADAPTIVE_WORDS_PER_THREAD 2048
+#define EDIT_LENGTHS (MAX_WORD_LENGTH-MIN_WORD_LENGTH+1)
+#define EDIT_BUCKETS (EDIT_LENGTHS*26)
+#define QW_COMPACT_MIN 1024
+#define MATCH_MEMORY_MB 1024
+#define PENDING_RING (1<<14)
+#define READY_RING (1<<12)
 
-enum PHASE { PH_IDLE, PH_01, PH_02, PH_FINISHED };
+enum EDIT_ENGINE { EE_SCAN, EE_TRIE, EE_FASTSS };
 
 using namespace std;
 
 #include <core.h>
+#include "matchlist.hpp"
 #include "word.hpp"
+#include "tokenizer.hpp"
+#include "letterhist.hpp"
+#include "arena.hpp"
 #include "dfatrie.hpp"
+#include "wordhash.hpp"
 #include "wordDB.hpp"
 #include "indexHashTable.hpp"
+#include "wordset.hpp"
 #include "core.hpp"
+#include "hamming.hpp"
+#include "listhash.hpp"
+#include "edittrie.hpp"
+#include "fastss.hpp"
+#include "hammseg.hpp"
+#include "workpool.hpp"
+#include "topology.hpp"
+#include "distbits.hpp"
+#include "mpmcqueue.hpp"
+#include "eventcount.hpp"
+#include "snapshot.hpp"
 
 /* Function prototypes */
 static void         PrintStats ();
 static void*        Thread (void *param);
-static inline void  Prepare ();
-static inline void  Match (long thread_id);
+static Batch*       NextBatch (long thread_id, unsigned &seq);
+static unsigned     BatchThreads (Batch &batch);
+static void         Sync (long thread_id, unsigned threads);
+static void         SealBatch ();
+static void         QueueQuery (QueryID query_id, const Query &q);
+static void         Deliver (Document &doc);
+static void         PushReady (Document &doc);
+static bool         TryPopReady (Document &doc);
+static Document     PopReady ();
+static inline void  ApplyQuery (QueryID query_id, const Query &q);
+static inline void  AcquireQueryWord (Word *nw, MatchType mt);
+static inline void  ReleaseQueryWord (Word *nw, MatchType mt);
+static inline int   KeyWord (const Query &q);
+static void         CompactEdit ();
+static void         CompactHamm ();
+static void         CollectMatches ();
+static inline void  ParsePending (Document &doc, long thread_id);
+static inline void  Prepare (Batch &batch);
+static inline void  PrepareTasks (Batch &batch, long thread_id);
+static inline void  BucketEdit ();
+static inline void  SortEditBucket (unsigned k);
+static inline void  Match (Batch &batch, long thread_id);
 static inline void  Intersect (long thread_d);
 static inline void  ParseDoc (Document &doc, const long thread_id);
-static inline int   HammingDist (char *dtxt, char *qtxt);
-static inline int   EditDist (char *ds, int dn, char *qs, unsigned qn, int *T, unsigned *qi);
+static inline int   EditDist (const unsigned *Peq, int dn, char *qs, unsigned qn, EditCol *C, unsigned *qi);
 
 /* Globals */
 static WordDB               GWDB;                           ///< Here store pointers to  EVERY  single word encountered.
 static IndexHashTable       mBatchWords(1<<13,1);
+static pthread_mutex_t      mBatchWords_mutex;
+static unsigned             mBatchWordsDone;                ///< Threads that have gathered their documents' words.
 
 /* Documents */
-static queue<Document>      mPendingDocs;                   ///< Documents that haven't yet been touched at all.
-static vector<Document>     mParsedDocs;                    ///< Documents that have been parsed.
-static queue<Document>      mReadyDocs;                     ///< Documents that have been completely processed and are ready for delivery.
+static MPMCQueue<Document>  mPendingDocs(PENDING_RING);      ///< Documents that haven't yet been touched at all.
+static deque<Batch>         mBatches;                       ///< Batches not yet matched. The last one takes the new documents.
+static unsigned             mBatchSeq;                      ///< How many batches have been matched.
+static MPMCQueue<Document>  mReadyDocs(READY_RING);          ///< Documents that have been completely processed and are ready for delivery.
+static queue<Document>      mReadyOverflow;                 ///< Takes the ready documents while mReadyDocs is full, and after that until drained.
+static unsigned             mReadyOverflowSize;
+static Document             mHeldDoc;                       ///< A ready document that did not fit in a GetAvailResults buffer.
+static bool                 mHeld;
+static priority_queue<Document, vector<Document>, LaterDoc> mReorderDocs; ///< Matched documents waiting for earlier ones, in ordered mode.
+static unsigned long        mDocSeq;                        ///< Documents submitted.
+static unsigned long        mDeliverSeq;                    ///< Documents delivered.
+static bool                 mInOrder;                       ///< Deliver in MatchDocument order.
+static ResultCallback       mResultCallback;                ///< Where results go instead of mReadyDocs, if set.
+static void*                mResultArg;
 static unsigned             mBatchId;
+static DocumentPool         mDocPool;                       ///< Delivered documents, kept for reuse.
 
 /* Queries */
 static vector<Query>        mActiveQueries;
+static unsigned             mNumQueries;                    ///< Active queries.
+static vector<vector<QueryID> > mQWQueries[3];              ///< Inverted index: the queries filed under each query word, by type and qwindex.
 static IndexHashTable       mQWHash[2] {IndexHashTable(1<<10, 0), IndexHashTable(1<<10, 0)};
-static vector<QWordE>       mQWEdit;
+static QWEditTable          mQWEdit;
 static unsigned             mQWLastEdit;
+static unsigned             mQWNewEdit;                     ///< Start of the mQWEdit slice being prepared.
+static vector<unsigned>     mQWEditSlice;                   ///< Where the mQWEdit slice of every batch starts.
+static vector<unsigned>     mQWEditLens;                    ///< For EE_SCAN: where each length starts in each slice, EDIT_LENGTHS+1 entries per batch.
+static vector<unsigned>     mQWRefs[2];                     ///< How many active queries have each query word, by qwindex.
+static vector<unsigned>     mQWEditPos;                     ///< Position of the live mQWEdit entry of each query word.
+static vector<pair<unsigned,unsigned> > mQWHammPos;         ///< Batch and position of the live mQWHamm entry of each query word.
+static unsigned             mQWDead[2];                     ///< Tombstoned entries of mQWHamm and mQWEdit.
+static unsigned             mQWHammEntries;                 ///< Entries of mQWHamm, live or dead.
+static unsigned long        mMatchMemory;                   ///< Bytes held by the match lists of all the words.
+static unsigned long        mMatchBudget;                   ///< Beyond this, the match lists of the least recently seen words are evicted.
+static unsigned long        mMatchEvictions;                ///< Words whose match lists have been evicted.
+static unsigned long        mMatchHits;                     ///< Batch words that had match lists to build on.
+static unsigned long        mMatchMisses;                   ///< Batch words compared with every live query word.
+static unsigned             mEditBuckets[EDIT_BUCKETS+1];   ///< The new slice, grouped by length and first letter.
+static EditTrie             mQWEditTrie;                    ///< The same words as mQWEdit, for EE_TRIE.
+static FastSSIndex          mQWEditFastSS;                  ///< Deletion variants of mQWEdit, for EE_FASTSS.
+static EDIT_ENGINE          mEditEngine;                    ///< How Intersect finds the edit distance matches.
 static vector<QWMap>        mQWHamm;
+static HammingSegIndex      mQWHammSeg;                     ///< Segments of the mQWHamm words, for the longer lengths.
+static HammingBatchFn       HammingBatch;                   ///< Hamming kernel, chosen at runtime.
 
 /* Threading */
-static volatile PHASE       mPhase;                         ///< Indicates in which phase the threads should be.
-static pthread_t            mThreads[NUM_THREADS];          ///<
-static pthread_mutex_t      mParsedDocs_mutex;              ///<
-static pthread_mutex_t      mPendingDocs_mutex;             ///<
-static pthread_cond_t       mPendingDocs_cond;              ///<
-static pthread_mutex_t      mReadyDocs_mutex;               ///<
-static pthread_cond_t       mReadyDocs_cond;                ///<
-static pthread_barrier_t    mBarrier;                       ///<
-
-struct LTWE {
-    bool operator()(const QWordE &qw1, const QWordE &qw2 ) const {
-        return strcmp(qw1.txt.chars, qw2.txt.chars ) < 0;
-    }
-} ltw;
+static bool                mFinished;                      ///< The threads should exit.
+static unsigned             mNumThreads;                    ///< Size of the worker pool.
+static bool                 mAdaptive;                      ///< Match small batches with fewer threads.
+static pthread_t*           mThreads;                       ///<
+static pthread_mutex_t      mPendingDocs_mutex;             ///< Guards mBatches.
+static pthread_cond_t       mPendingDocs_cond;              ///< Signals DestroyIndex that a batch was matched.
+static EventCount           mWorkEvent;                     ///< The workers wait here for documents, batches and Sync().
+static pthread_mutex_t      mReadyDocs_mutex;               ///< Serializes delivery in order or to the callback.
+static pthread_mutex_t      mReadyOverflow_mutex;           ///< Guards mReadyOverflow and mHeldDoc.
+static EventCount           mReadyEvent;                    ///< The consumers wait here for ready documents.
+static unsigned            mSyncCount;                     ///< Threads waiting at Sync().
+static unsigned            mSyncGen;                       ///< Incremented every time all threads reach Sync().
+static WorkPool            mPrepareWork;                   ///< Splits the sorting tasks of Prepare among the threads.
+static WorkPool            mGatherWork;                    ///< Splits the documents of the batch for gathering mBatchWords.
+static WorkPool            mIntersectWork;                 ///< Splits mBatchWords among the threads.
+static WorkPool            mMatchWork;                     ///< Splits the documents of the batch among the threads.
+static DistBits*           mMatchBits;                     ///< Edit and Hamming levels of the document each thread matches.
+
+/* Statistics */
+struct alignas(64) ThreadTimes {
+    unsigned long busy;                                     ///< Nanoseconds spent on batch phases and parsing.
+    unsigned long idle;                                     ///< Nanoseconds spent waiting for the other threads at Sync().
+    unsigned long mark;                                     ///< When the current phase started.
+};
+static ThreadTimes*         mThreadTimes;
+
+static inline unsigned long Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
 
-struct LTWH {
-    bool operator()(const QWordH &qw1, const QWordH &qw2 ) const {
-        return strcmp(qw1.txt.chars, qw2.txt.chars ) < 0;
+/** Orders positions of a text column by their words. */
+struct LTW {
+    const vector<WordText> &txt;
+    bool operator()(unsigned j1, unsigned j2) const {
+        return strcmp(txt[j1].chars, txt[j2].chars) < 0;
     }
-} ltwh;
+};
 
 /* Library Functions */
 ErrorCode InitializeIndex()
 {
     /* Create the mThreads, which will enter the waiting state. */
     pthread_mutex_init(&mPendingDocs_mutex, NULL);
-    pthread_mutex_init(&mParsedDocs_mutex,  NULL);
     pthread_cond_init (&mPendingDocs_cond,  NULL);
     pthread_mutex_init(&mReadyDocs_mutex,   NULL);
-    pthread_cond_init (&mReadyDocs_cond,    NULL);
-    pthread_barrier_init(&mBarrier, NULL,   NUM_THREADS);
+    pthread_mutex_init(&mReadyOverflow_mutex, NULL);
+    pthread_mutex_init(&mBatchWords_mutex,  NULL);
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
     mQWHamm.resize(mBatchId+1);
-    mPhase = PH_IDLE;
-
-    for (long t=0; t< NUM_THREADS; t++) {
+    mQWEditSlice.push_back(0);
+    HammingBatch = HammingSelect();
+    const char *ee = getenv("SIGMOD_EDIT_ENGINE");
+    if (ee && !strcmp(ee, "trie")) mEditEngine = EE_TRIE;
+    else if (ee && !strcmp(ee, "fastss")) mEditEngine = EE_FASTSS;
+    else mEditEngine = EE_SCAN;
+    mDocSeq = mDeliverSeq = 0;
+    mBatches.emplace_back(mDocSeq);
+    mFinished = false;
+
+    /* One worker per available CPU, unless overridden. */
+    const char *nt = getenv("SIGMOD_THREADS");
+    mNumThreads = nt && atoi(nt) > 0 ? atoi(nt) : AllowedCpus().size();
+    const char *mm = getenv("SIGMOD_MATCH_MB");
+    mMatchBudget = (mm && atol(mm) > 0 ? atol(mm) : MATCH_MEMORY_MB) << 20;
+    const char *nw = getenv("SIGMOD_WORDS");
+    if (nw && atol(nw) > 0) GWDB.reserve(atol(nw));
+    const char *ad = getenv("SIGMOD_ADAPTIVE");
+    mAdaptive = ad && atoi(ad);
+    const char *pin = getenv("SIGMOD_PIN");
+    vector<int> cpus;
+    if (pin && (!strcmp(pin, "compact") || !strcmp(pin, "spread")))
+        cpus = PlaceThreads(mNumThreads, !strcmp(pin, "spread"));
+
+    mThreads = new pthread_t[mNumThreads];
+    if (posix_memalign((void**) &mThreadTimes, 64, mNumThreads*sizeof(ThreadTimes))) exit(-1);
+    memset(mThreadTimes, 0, mNumThreads*sizeof(ThreadTimes));
+    mPrepareWork.init(mNumThreads);
+    mGatherWork.init(mNumThreads);
+    mIntersectWork.init(mNumThreads);
+    mMatchWork.init(mNumThreads);
+    mMatchBits = new DistBits[2*mNumThreads];
+
+    for (long t=0; t< mNumThreads; t++) {
         int rc = pthread_create(&mThreads[t], &attr, Thread, (void *)t);
         if (rc) { fprintf(stderr, "ERROR; return code from pthread_create() is %d\n", rc); exit(-1);}
+        if (!cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[t], &set);
+            pthread_setaffinity_np(mThreads[t], sizeof(set), &set);
+        }
     }
 
     return EC_SUCCESS;
@@ -101,96 +236,86 @@ ErrorCode InitializeIndex()
 ErrorCode DestroyIndex()
 {
     pthread_mutex_lock(&mPendingDocs_mutex);
-    mPhase = PH_FINISHED;
-    pthread_cond_broadcast(&mPendingDocs_cond);
+    if (mBatches.back().numDocs) SealBatch();
+    while (mBatches.size() > 1)
+        pthread_cond_wait(&mPendingDocs_cond, &mPendingDocs_mutex);
+    mFinished = true;
     pthread_mutex_unlock(&mPendingDocs_mutex);
+    mWorkEvent.notifyAll();
 
-    for (long t=0; t<NUM_THREADS; t++) {
+    for (long t=0; t<mNumThreads; t++) {
         pthread_join(mThreads[t], NULL);
     }
 
     PrintStats(); fflush(NULL);
+    GWDB.clear();
+    delete[] mThreads;
+    free(mThreadTimes);
+    delete[] mMatchBits;
 
     return EC_SUCCESS;
 }
 
 ErrorCode StartQuery(QueryID query_id, const char* query_str, MatchType match_type, unsigned int match_dist)
 {
-    WordText wtxt;
-    const char *c2;
-    int num_words=0, i;
-    Word* nw;
-
-    if (mActiveQueries.size() < query_id+1)
-        mActiveQueries.resize(query_id+1);
+    char qstr[MAX_QUERY_LENGTH+1+TOKEN_PAD];
+    Query q;
+    int num_words=0;
 
-    c2 = query_str-1;
-    do {
-        for (unsigned wi=0; wi<WUNITS_MAX; wi++) wtxt.ints[wi]=0;
-        i=0; do {wtxt.chars[i++] = *++c2;} while (*c2!=' ' && *c2 );
-        wtxt.chars[--i] = 0;
+    strncpy(qstr, query_str, MAX_QUERY_LENGTH);
+    memset(qstr+MAX_QUERY_LENGTH, 0, 1+TOKEN_PAD);  /* The terminator and the pad Tokenize may read */
 
+    Tokenize(qstr, [&](const char *w, int len) {
+        WordText wtxt;
+        Word* nw;
+        MakeWordText(w, len, wtxt);
         GWDB.insert(wtxt, &nw);
-        mActiveQueries[query_id].words[num_words] = nw;
-        if (match_type!=MT_EXACT_MATCH && mQWHash[match_type-1].insert(nw->wid)) {
-            nw->qwindex[match_type] = mQWHash[match_type-1].size()-1;
-            if (match_type==MT_EDIT_DIST) mQWEdit.emplace_back(nw, match_type);
-            else mQWHamm[mBatchId][nw->length].emplace_back(nw, match_type);
-        }
+        q.words[num_words++] = nw;
+    });
 
-        num_words++;
-    } while (*c2);
-
-    mActiveQueries[query_id].type = match_type;
-    mActiveQueries[query_id].dist = match_dist;
-    mActiveQueries[query_id].numWords = num_words;
+    q.type = match_type;
+    q.dist = match_dist;
+    q.numWords = num_words;
+    QueueQuery(query_id, q);
 
     return EC_SUCCESS;
 }
 
 ErrorCode EndQuery(QueryID query_id)
 {
-    mActiveQueries[query_id].numWords=0;
+    Query q;
+    q.numWords = 0;
+    QueueQuery(query_id, q);
     return EC_SUCCESS;
 }
 
 ErrorCode MatchDocument(DocID doc_id, const char* doc_str)
 {
-    char *new_doc_str = (char *) malloc((1+strlen(doc_str)));
-    if (!new_doc_str){ fprintf(stderr, "Could not allocate memory. \n");fflush(stderr); return EC_FAIL;}
-    strcpy(new_doc_str, doc_str);
-
-    Document newDoc;
-    newDoc.id = doc_id;
-    newDoc.str = new_doc_str;
-    newDoc.words = new IndexHashTable(0, 1);
-    newDoc.matchingQueries = new vector<QueryID>();
+    Document newDoc = mDocPool.get(doc_id, doc_str);
+    if (!newDoc.str){ fprintf(stderr, "Could not allocate memory. \n");fflush(stderr); return EC_FAIL;}
 
     pthread_mutex_lock(&mPendingDocs_mutex);
-    mPendingDocs.push(newDoc);
-    mPhase = PH_01;
-    pthread_cond_broadcast(&mPendingDocs_cond);
+    newDoc.seq = mDocSeq++;
+    newDoc.batch = &mBatches.back();
+    newDoc.batch->docs.reserve(newDoc.seq - newDoc.batch->firstSeq);
+    __atomic_add_fetch(&newDoc.batch->numDocs, 1, __ATOMIC_SEQ_CST);
     pthread_mutex_unlock(&mPendingDocs_mutex);
+
+    /* Full only when the workers fall far behind; they drain it without us. */
+    while (!mPendingDocs.push(newDoc)) sched_yield();
+    mWorkEvent.notifyOne();
     return EC_SUCCESS;
 }
 
 ErrorCode GetNextAvailRes(DocID* p_doc_id, unsigned int* p_num_res, QueryID** p_query_ids)
 {
-    pthread_mutex_lock(&mPendingDocs_mutex);
-    if (mPhase==PH_01) mPhase = PH_02;
-    pthread_cond_broadcast(&mPendingDocs_cond);
-    pthread_mutex_unlock(&mPendingDocs_mutex);
-
-    pthread_mutex_lock(&mReadyDocs_mutex);
-    while ( mReadyDocs.empty() )
-        pthread_cond_wait(&mReadyDocs_cond, &mReadyDocs_mutex);
-
     *p_doc_id=0;
     *p_num_res=0;
     *p_query_ids=0;
-    if(mReadyDocs.empty()) return EC_NO_AVAIL_RES;
-    Document res = mReadyDocs.front();
-    mReadyDocs.pop();
+    if (mResultCallback) return EC_FAIL;
+
+    Document res = PopReady();
+
     *p_doc_id = res.id;
     *p_num_res = res.matchingQueries->size();
 
@@ -202,12 +327,486 @@ ErrorCode GetNextAvailRes(DocID* p_doc_id, unsigned int* p_num_res, QueryID** p_
     }
     else *p_query_ids=NULL;
 
-    delete res.matchingQueries;
-    delete res.words;
-    free(res.str);
+    mDocPool.put(res);
+    return EC_SUCCESS;
+}
+
+ErrorCode SetResultOrder(int in_order)
+{
+    mInOrder = in_order;
+    return EC_SUCCESS;
+}
+
+ErrorCode SetResultCallback(ResultCallback callback, void* arg)
+{
+    mResultCallback = callback;
+    mResultArg = arg;
+    return EC_SUCCESS;
+}
+
+/**
+ * Waits for one ready document, then takes more from the ready queue
+ * without blocking, as long as they fit. The first document that does
+ * not fit is put back as mHeldDoc, to come out first on the next call.
+ * With several consumers, documents popped meanwhile by the others come
+ * out before it, and one put back while another is held goes behind the
+ * queued documents. Fails only when the results of the first document
+ * alone overflow `query_ids`; its id and size are then left in p_docs[0],
+ * so the caller can grow the buffer.
+ */
+ErrorCode GetAvailResults(DocResult* p_docs, unsigned int max_docs, QueryID* query_ids, unsigned int max_ids, unsigned int* p_num_docs)
+{
+    *p_num_docs = 0;
+    if (mResultCallback || !max_docs) return EC_FAIL;
+
+    unsigned n=0, used=0;
+    Document res = PopReady();
+    while (1) {
+        unsigned num = res.matchingQueries->size();
+        p_docs[n].doc_id = res.id;
+        p_docs[n].num_res = num;
+        p_docs[n].query_ids = NULL;
+        if (used+num > max_ids) {
+            pthread_mutex_lock(&mReadyOverflow_mutex);
+            if (mHeld) {
+                /* Another consumer holds one already */
+                mReadyOverflow.push(res);
+                __atomic_add_fetch(&mReadyOverflowSize, 1, __ATOMIC_RELEASE);
+            }
+            else {
+                mHeldDoc = res;
+                __atomic_store_n(&mHeld, true, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&mReadyOverflow_mutex);
+            mReadyEvent.notifyOne();
+            break;
+        }
+
+        if (num) {
+            p_docs[n].query_ids = query_ids+used;
+            memcpy(query_ids+used, res.matchingQueries->data(), num*sizeof(QueryID));
+            used += num;
+        }
+        mDocPool.put(res);
+        if (++n == max_docs || !TryPopReady(res)) break;
+    }
+
+    *p_num_docs = n;
+    return n ? EC_SUCCESS : EC_FAIL;
+}
+
+/** The sizes the snapshot layout depends on, written next to the magic. */
+static vector<unsigned> SnapshotLayout()
+{
+    return vector<unsigned> { (unsigned) sizeof(WordText), (unsigned) sizeof(WordRecord), (unsigned) sizeof(QueryRecord),
+                              (unsigned) sizeof(LetterHist), MIN_WORD_LENGTH, MAX_WORD_LENGTH, MAX_QUERY_WORDS };
+}
+
+static QueryRecord SaveQuery(const Query &q)
+{
+    QueryRecord r;
+    memset(&r, 0, sizeof(r));
+    for (int i=0 ; i<q.numWords ; i++) r.wids[i] = q.words[i]->wid;
+    r.type = q.type;
+    r.numWords = q.numWords;
+    r.dist = q.dist;
+    r.key = q.key;
+    return r;
+}
+
+static Query LoadQuery(const QueryRecord &r)
+{
+    Query q;
+    for (int i=0 ; i<r.numWords ; i++) q.words[i] = GWDB.getWord(r.wids[i]);
+    q.type = (MatchType) r.type;
+    q.numWords = r.numWords;
+    q.dist = r.dist;
+    q.key = r.key;
+    return q;
+}
+
+/**
+ * Writes everything that LoadIndex cannot cheaply derive: the words with
+ * their match lists, the query word tables, the queries and the query
+ * changes still queued. The trie, FastSS and segment indexes are rebuilt
+ * from the tables instead. The file starts with the magic, the sizes of
+ * the records (SnapshotLayout) and the edit engine.
+ */
+ErrorCode SaveIndex(const char* path)
+{
+    pthread_mutex_lock(&mPendingDocs_mutex);
+    if (mBatches.back().numDocs) SealBatch();
+    while (mBatches.size() > 1)
+        pthread_cond_wait(&mPendingDocs_cond, &mPendingDocs_mutex);
+
+    SnapshotWriter out(path);
+    out.put(SNAPSHOT_MAGIC);
+    out.array(SnapshotLayout());
+    out.put((unsigned) mEditEngine);
+    out.put(mBatchId);
+    out.put(mNumQueries);
+    out.put(mQWHammEntries);
+    out.array(mQWDead, 2);
+
+    /* The dictionary, and the match lists of every word back to back */
+    unsigned nwords = GWDB.size();
+    vector<WordText> txt(nwords);
+    vector<WordRecord> words(nwords);
+    vector<unsigned> offsets(1, 0), matches;
+    for (unsigned wid=0 ; wid<nwords ; wid++) {
+        Word *w = GWDB.getWord(wid);
+        memset(&txt[wid], 0, sizeof(WordText));
+        memset(&words[wid], 0, sizeof(WordRecord));
+        if (w) {
+            txt[wid] = w->txt;
+            words[wid] = WordRecord{ w->batchFreq, w->lastSeen, w->lastCheck_edit, w->lastCheck_hamm,
+                                     { w->qwindex[0], w->qwindex[1], w->qwindex[2] }, 1 };
+            matches.insert(matches.end(), w->editMatches.begin(), w->editMatches.end());
+            offsets.push_back(matches.size());
+            matches.insert(matches.end(), w->hammMatches.begin(), w->hammMatches.end());
+            offsets.push_back(matches.size());
+        }
+        else {
+            offsets.push_back(matches.size());
+            offsets.push_back(matches.size());
+        }
+    }
+    out.array(txt);
+    out.array(words);
+    out.array(offsets);
+    out.array(matches);
+
+    /* The query word tables */
+    out.array(mQWRefs[0]);
+    out.array(mQWRefs[1]);
+    out.array(mQWEditPos);
+    out.array(mQWHammPos);
+    out.array(mQWEditSlice);
+    out.array(mQWEditLens);
+    out.array(mQWEdit.hist);
+    out.array(mQWEdit.prefix);
+    out.array(mQWEdit.dead);
+    out.array(mQWEdit.length);
+    out.array(mQWEdit.letterBits);
+    out.array(mQWEdit.qwindex);
+    out.array(mQWEdit.txt);
+    for (unsigned b=0 ; b<=mBatchId ; b++)
+        for (int len=MIN_WORD_LENGTH; len<=MAX_WORD_LENGTH; len++) {
+            out.array(mQWHamm[b][len].txt);
+            out.array(mQWHamm[b][len].dead);
+            out.array(mQWHamm[b][len].qwindex);
+        }
+
+    /* The queries, the inverted index and the queued query changes */
+    vector<QueryRecord> queries;
+    for (const Query &q : mActiveQueries) queries.push_back(SaveQuery(q));
+    out.array(queries);
+    for (int t=0 ; t<3 ; t++) {
+        vector<unsigned> filed_offsets(1, 0), filed;
+        for (const vector<QueryID> &f : mQWQueries[t]) {
+            filed.insert(filed.end(), f.begin(), f.end());
+            filed_offsets.push_back(filed.size());
+        }
+        out.array(filed_offsets);
+        out.array(filed);
+    }
+    vector<QueryID> queued_ids;
+    vector<QueryRecord> queued;
+    for (auto &bq : mBatches.back().queries) {
+        queued_ids.push_back(bq.first);
+        queued.push_back(SaveQuery(bq.second));
+    }
+    out.array(queued_ids);
+    out.array(queued);
+    pthread_mutex_unlock(&mPendingDocs_mutex);
+
+    return out.close() ? EC_SUCCESS : EC_FAIL;
+}
+
+/** The length of `t` if it holds a word: 1 to MAX_WORD_LENGTH letters, then zeros. Otherwise -1. */
+static int TextLength(const WordText &t)
+{
+    int len = 0;
+    while (len<=MAX_WORD_LENGTH && t.chars[len]>='a' && t.chars[len]<='z') len++;
+    for (int i=len ; i<=MAX_WORD_LENGTH ; i++)
+        if (t.chars[i]) return -1;
+    return len>=1 && len<=MAX_WORD_LENGTH ? len : -1;
+}
+
+/** Whether `offs` splits an array of `n` entries into consecutive ranges. */
+static bool ValidOffsets(const vector<unsigned> &offs, unsigned long n)
+{
+    if (offs.empty() || offs[0] || offs.back() != n) return false;
+    for (unsigned i=1 ; i<offs.size() ; i++)
+        if (offs[i] < offs[i-1]) return false;
+    return true;
+}
+
+/**
+ * A snapshot as read back by LoadIndex. It is checked in full before any
+ * of it goes into the index: every index, position, offset and length is
+ * within the table it refers to, so a damaged file is refused instead of
+ * corrupting the index.
+ */
+struct IndexImage {
+    unsigned                        batchId, numQueries, hammEntries;
+    vector<unsigned>                dead;
+    vector<WordText>                txt;
+    vector<WordRecord>              words;
+    vector<unsigned>                offsets, matches;
+    vector<unsigned>                refs[2], editPos, editSlice, editLens;
+    vector<pair<unsigned,unsigned> > hammPos;
+    QWEditTable                     edit;
+    vector<QWMap>                   hamm;
+    vector<QueryRecord>             queries, queued;
+    vector<unsigned>                filedOffsets[3], filed[3];
+    vector<QueryID>                 queuedIds;
+
+    /** Reads the arrays in the order SaveIndex writes them. */
+    bool read (SnapshotReader &in) {
+        in.get(batchId);
+        in.get(numQueries);
+        in.get(hammEntries);
+        in.array(dead);
+        in.array(txt);
+        in.array(words);
+        in.array(offsets);
+        in.array(matches);
+        in.array(refs[0]);
+        in.array(refs[1]);
+        in.array(editPos);
+        in.array(hammPos);
+        in.array(editSlice);
+        in.array(editLens);
+        in.array(edit.hist);
+        in.array(edit.prefix);
+        in.array(edit.dead);
+        in.array(edit.length);
+        in.array(edit.letterBits);
+        in.array(edit.qwindex);
+        in.array(edit.txt);
+        /* One batch at a time, so a bad batch id cannot make us allocate much */
+        while (in.good() && hamm.size() <= batchId) {
+            hamm.emplace_back();
+            for (int len=MIN_WORD_LENGTH; len<=MAX_WORD_LENGTH; len++) {
+                in.array(hamm.back()[len].txt);
+                in.array(hamm.back()[len].dead);
+                in.array(hamm.back()[len].qwindex);
+            }
+        }
+        in.array(queries);
+        for (int t=0 ; t<3 ; t++) {
+            in.array(filedOffsets[t]);
+            in.array(filed[t]);
+        }
+        in.array(queuedIds);
+        in.array(queued);
+        return in.good();
+    }
+
+    bool valid () const {
+        unsigned nwords = words.size(), nedit = edit.size();
+        if (dead.size() != 2 || txt.size() != nwords || !ValidOffsets(offsets, matches.size()) || offsets.size() != 2UL*nwords+1)
+            return false;
+        if (hamm.size() != (unsigned long) batchId+1 || editSlice.size() != (unsigned long) batchId+1)
+            return false;
+        for (int t=0 ; t<3 ; t++)
+            if (!ValidOffsets(filedOffsets[t], filed[t].size())) return false;
+        if (editPos.size() != refs[MT_EDIT_DIST-1].size() || hammPos.size() != refs[MT_HAMMING_DIST-1].size())
+            return false;
+
+        /* The words: distinct texts, their state and match lists within the tables */
+        unsigned long bound[3] = { filedOffsets[MT_EXACT_MATCH].size()-1, refs[MT_HAMMING_DIST-1].size(), refs[MT_EDIT_DIST-1].size() };
+        vector<int> length(nwords, 0);
+        vector<unsigned> present;
+        vector<char> taken[3] { vector<char>(bound[0], 0), vector<char>(bound[1], 0), vector<char>(bound[2], 0) };
+        unsigned long numTaken[3] = { 0, 0, 0 };
+        for (unsigned wid=0 ; wid<nwords ; wid++) {
+            const WordRecord &r = words[wid];
+            if (r.present > 1 || (!r.present && offsets[2*wid+2] != offsets[2*wid])) return false;
+            if (!r.present) continue;
+            present.push_back(wid);
+            if ((length[wid] = TextLength(txt[wid])) < 0) return false;
+            if (r.lastSeen > batchId || r.lastCheck_edit > batchId || r.lastCheck_hamm > batchId) return false;
+            for (int t=0 ; t<3 ; t++) {
+                if (r.qwindex[t] < -1 || (r.qwindex[t] >= 0 && (unsigned) r.qwindex[t] >= bound[t])) return false;
+                if (r.qwindex[t] < 0) continue;
+                if (length[wid] < MIN_WORD_LENGTH || taken[t][r.qwindex[t]]) return false;
+                taken[t][r.qwindex[t]] = 1;
+                numTaken[t]++;
+            }
+            for (unsigned k=offsets[2*wid] ; k<offsets[2*wid+1] ; k++)
+                if (MatchList::qwindex(matches[k]) >= bound[MT_EDIT_DIST]) return false;
+            for (unsigned k=offsets[2*wid+1] ; k<offsets[2*wid+2] ; k++)
+                if (MatchList::qwindex(matches[k]) >= bound[MT_HAMMING_DIST]) return false;
+        }
+        /* Every index of a table belongs to exactly one word, as AcquireQueryWord and ApplyQuery hand them out */
+        for (int t=0 ; t<3 ; t++)
+            if (numTaken[t] != bound[t]) return false;
+        sort(present.begin(), present.end(), LTW{txt});
+        for (unsigned i=1 ; i<present.size() ; i++)
+            if (!memcmp(&txt[present[i-1]], &txt[present[i]], sizeof(WordText))) return false;
+
+        /* The edit table and its slices */
+        if (edit.hist.size() != nedit || edit.prefix.size() != nedit || edit.dead.size() != nedit || edit.length.size() != nedit ||
+            edit.letterBits.size() != nedit || edit.txt.size() != nedit)
+            return false;
+        for (unsigned j=0 ; j<nedit ; j++) {
+            if (edit.qwindex[j] >= bound[MT_EDIT_DIST] || edit.dead[j] > 1 || edit.prefix[j] > MAX_WORD_LENGTH) return false;
+            if (edit.length[j] < MIN_WORD_LENGTH || TextLength(edit.txt[j]) != edit.length[j]) return false;
+        }
+        if (editSlice[0] || editSlice.back() > nedit) return false;
+        for (unsigned b=1 ; b<editSlice.size() ; b++)
+            if (editSlice[b] < editSlice[b-1]) return false;
+        if (mEditEngine==EE_SCAN && editLens.size() != (unsigned long) batchId*(EDIT_LENGTHS+1)) return false;
+        for (unsigned l : editLens)
+            if (l > nedit) return false;
+
+        /* The Hamming buckets */
+        unsigned long entries = 0;
+        for (unsigned b=0 ; b<=batchId ; b++)
+            for (int len=MIN_WORD_LENGTH; len<=MAX_WORD_LENGTH; len++) {
+                const QWHammBucket &bucket = hamm[b][len];
+                if (bucket.txt.size() != bucket.size() || bucket.dead.size() != bucket.size()) return false;
+                for (unsigned k=0 ; k<bucket.size() ; k++)
+                    if (bucket.qwindex[k] >= bound[MT_HAMMING_DIST] || bucket.dead[k] > 1 || TextLength(bucket.txt[k]) != len)
+                        return false;
+                entries += bucket.size();
+            }
+        if (entries != hammEntries || dead[MT_HAMMING_DIST-1] > hammEntries || dead[MT_EDIT_DIST-1] > nedit) return false;
+
+        /* The positions of the live query words */
+        for (unsigned q=0 ; q<editPos.size() ; q++)
+            if (refs[MT_EDIT_DIST-1][q] && editPos[q] >= nedit) return false;
+        for (unsigned wid : present) {
+            int q = words[wid].qwindex[MT_HAMMING_DIST];
+            if (q < 0 || !refs[MT_HAMMING_DIST-1][q]) continue;
+            if (hammPos[q].first > batchId || hammPos[q].second >= hamm[hammPos[q].first][length[wid]].size()) return false;
+        }
+
+        /* The queries, each filed once under its key word, and the queued ones, whose key is not chosen yet */
+        auto validQuery = [&](const QueryRecord &r, bool applied) {
+            if (r.numWords < 1 || r.numWords > MAX_QUERY_WORDS || r.type < MT_EXACT_MATCH || r.type > MT_EDIT_DIST) return false;
+            if (r.type != MT_EXACT_MATCH && (r.dist < 0 || r.dist > 3)) return false;
+            if (applied && (r.key < 0 || r.key >= r.numWords)) return false;
+            for (int i=0 ; i<r.numWords ; i++)
+                if (r.wids[i] >= nwords || !words[r.wids[i]].present || length[r.wids[i]] < MIN_WORD_LENGTH) return false;
+            return true;
+        };
+        unsigned active = 0;
+        for (const QueryRecord &r : queries) {
+            if (!r.numWords) continue;
+            if (!validQuery(r, true)) return false;
+            /* Exact matches file only the key word; the others hold every word */
+            for (int i=0 ; i<r.numWords ; i++) {
+                int q = words[r.wids[i]].qwindex[r.type];
+                if (r.type == MT_EXACT_MATCH) { if (i == r.key && q < 0) return false; }
+                else if (q < 0 || !refs[r.type-1][q]) return false;
+            }
+            active++;
+        }
+        if (active != numQueries) return false;
+        vector<char> seen(queries.size(), 0);
+        unsigned long numFiled = 0;
+        for (int t=0 ; t<3 ; t++)
+            for (unsigned k=0 ; k+1<filedOffsets[t].size() ; k++)
+                for (unsigned i=filedOffsets[t][k] ; i<filedOffsets[t][k+1] ; i++) {
+                    QueryID id = filed[t][i];
+                    if (id >= queries.size() || seen[id]) return false;
+                    const QueryRecord &r = queries[id];
+                    if (!r.numWords || r.type != t || words[r.wids[(int) r.key]].qwindex[t] != (int) k) return false;
+                    seen[id] = 1;
+                    numFiled++;
+                }
+        if (numFiled != active) return false;
+        if (queuedIds.size() != queued.size()) return false;
+        for (const QueryRecord &r : queued)
+            if (r.numWords && !validQuery(r, false)) return false;
+        return true;
+    }
+};
+
+/**
+ * Restores a snapshot of SaveIndex into an index that has seen nothing
+ * yet. Everything is read and checked before the index is touched, so a
+ * bad file leaves it empty. No distance is recomputed: the word ids, the
+ * query word positions and the match lists come back as they were.
+ */
+ErrorCode LoadIndex(const char* path)
+{
+    SnapshotReader in(path);
+    unsigned long magic = 0;
+    vector<unsigned> layout;
+    unsigned engine = ~0u;
+    in.get(magic);
+    in.array(layout);
+    in.get(engine);
+    if (!in.good() || magic != SNAPSHOT_MAGIC || layout != SnapshotLayout() || engine != (unsigned) mEditEngine) return EC_FAIL;
+
+    IndexImage image;
+    if (!image.read(in) || !image.valid()) return EC_FAIL;
+
+    pthread_mutex_lock(&mPendingDocs_mutex);
+    if (GWDB.size() || mBatchId || mBatches.size() > 1 || mBatches.back().numDocs || !mBatches.back().queries.empty()) {
+        pthread_mutex_unlock(&mPendingDocs_mutex);
+        return EC_FAIL;
+    }
+
+    /* The words keep their ids, so every table that refers to them stays valid. */
+    unsigned long memory = 0;
+    const vector<unsigned> &offsets = image.offsets;
+    for (unsigned wid=0 ; wid<image.words.size() ; wid++) {
+        const WordRecord &r = image.words[wid];
+        Word *w = GWDB.restore(r.present ? &image.txt[wid] : NULL);
+        if (!w) continue;
+        w->batchFreq = r.batchFreq;
+        w->lastSeen = r.lastSeen;
+        w->lastCheck_edit = r.lastCheck_edit;
+        w->lastCheck_hamm = r.lastCheck_hamm;
+        for (int t=0 ; t<3 ; t++) w->qwindex[t] = r.qwindex[t];
+        w->editMatches.assign(image.matches.data()+offsets[2*wid], offsets[2*wid+1]-offsets[2*wid]);
+        w->hammMatches.assign(image.matches.data()+offsets[2*wid+1], offsets[2*wid+2]-offsets[2*wid+1]);
+        memory += w->editMatches.memory() + w->hammMatches.memory();
+        if (w->qwindex[MT_EDIT_DIST] >= 0) mQWHash[MT_EDIT_DIST-1].insert(wid);
+        if (w->qwindex[MT_HAMMING_DIST] >= 0) mQWHash[MT_HAMMING_DIST-1].insert(wid);
+    }
+    mMatchMemory = memory;
+
+    mBatchId = image.batchId;
+    mNumQueries = image.numQueries;
+    mQWHammEntries = image.hammEntries;
+    mQWDead[0] = image.dead[0];
+    mQWDead[1] = image.dead[1];
+    mQWRefs[0].swap(image.refs[0]);
+    mQWRefs[1].swap(image.refs[1]);
+    mQWEditPos.swap(image.editPos);
+    mQWHammPos.swap(image.hammPos);
+    mQWEditSlice.swap(image.editSlice);
+    mQWEditLens.swap(image.editLens);
+    swap(mQWEdit, image.edit);
+    mQWHamm.swap(image.hamm);
+
+    for (const QueryRecord &r : image.queries) mActiveQueries.push_back(LoadQuery(r));
+    for (int t=0 ; t<3 ; t++) {
+        const vector<unsigned> &offs = image.filedOffsets[t];
+        mQWQueries[t].resize(offs.size()-1);
+        for (unsigned k=0 ; k<mQWQueries[t].size() ; k++)
+            mQWQueries[t][k].assign(image.filed[t].begin()+offs[k], image.filed[t].begin()+offs[k+1]);
+    }
+    for (unsigned i=0 ; i<image.queued.size() ; i++)
+        mBatches.back().queries.emplace_back(image.queuedIds[i], LoadQuery(image.queued[i]));
+
+    /* The indexes over the tables */
+    for (unsigned b=0 ; b+1<mQWEditSlice.size() ; b++)
+        for (unsigned j=mQWEditSlice[b] ; j<mQWEditSlice[b+1] ; j++) {
+            if (mEditEngine==EE_TRIE) mQWEditTrie.insert(mQWEdit, j, b+1);
+            else if (mEditEngine==EE_FASTSS) mQWEditFastSS.insert(mQWEdit, j);
+        }
+    for (unsigned b=0 ; b<mBatchId ; b++)
+        for (int len=MIN_WORD_LENGTH; len<=MAX_WORD_LENGTH; len++)
+            mQWHammSeg.insert(mQWHamm[b][len], len, b);
+    pthread_mutex_unlock(&mPendingDocs_mutex);
 
-    pthread_cond_broadcast(&mReadyDocs_cond);
-    pthread_mutex_unlock(&mReadyDocs_mutex);
     return EC_SUCCESS;
 }
 
@@ -217,7 +816,23 @@ void PrintStats()
     fprintf(stdout, "\n=== STATS ================================== BATCH ===================================\n");
     fprintf(stdout, "GWDB     Exact   Hamming   Edit    |  BatchID   ActiveQueries   batchDocs   batchWords   \n");
     fprintf(stdout, "%-6u     -     %-7u   %-5u   |  %-7d   %-13lu   %-9lu   %-10u   \n",
-                     GWDB.size(), mQWHash[0].size(), mQWHash[1].size(), mBatchId, (unsigned long) mActiveQueries.size(), (unsigned long) mParsedDocs.size(), mBatchWords.size());
+                     GWDB.size(), mQWHash[0].size(), mQWHash[1].size(), mBatchId, (unsigned long) mNumQueries, (unsigned long) mBatches.back().numDocs, mBatchWords.size());
+    const char *ee_name[] = { "scan", "trie", "fastss" };
+    unsigned long ee_mem = mEditEngine==EE_TRIE   ? mQWEditTrie.memory() :
+                           mEditEngine==EE_FASTSS ? mQWEditFastSS.memory() : 0;
+    fprintf(stdout, "EditEngine: %-6s   Index: %.1f MB   |  HammingSegIndex: %.1f MB   |  GWDB: %.1f MB\n",
+                     ee_name[mEditEngine], ee_mem/1048576.0, mQWHammSeg.memory()/1048576.0, GWDB.memory()/1048576.0);
+    unsigned long lookups = max(mMatchHits + mMatchMisses, 1UL);
+    fprintf(stdout, "MatchLists: %.1f MB of %lu MB   |  Hits: %lu (%.1f%%)  Misses: %lu   |  Evicted: %lu words\n",
+                     mMatchMemory/1048576.0, mMatchBudget >> 20, mMatchHits, 100.0*mMatchHits/lookups, mMatchMisses, mMatchEvictions);
+    double busy_min=1e30, busy_max=0, busy_sum=0, idle_max=0, idle_sum=0;
+    for (long t=0; t<mNumThreads; t++) {
+        double busy = mThreadTimes[t].busy/1e6, idle = mThreadTimes[t].idle/1e6;
+        busy_min = min(busy_min, busy); busy_max = max(busy_max, busy); busy_sum += busy;
+        idle_max = max(idle_max, idle); idle_sum += idle;
+    }
+    fprintf(stdout, "Threads: %-3u%s   Busy ms: min %.0f  avg %.0f  max %.0f   |  Idle at Sync ms: avg %.0f  max %.0f\n",
+                     mNumThreads, mAdaptive ? " (adaptive)" : "", busy_min, busy_sum/mNumThreads, busy_max, idle_sum/mNumThreads, idle_max);
     fprintf(stdout, "======================================================================================\n");
     fflush(NULL);
 }
@@ -225,121 +840,635 @@ void PrintStats()
 void* Thread(void *param)
 {
     const long myThreadId = (long) param;
+    mThreadTimes[myThreadId].mark = Now();
 
-    while (1)
+    for (unsigned seq=0 ; ; seq++)
     {
-        pthread_barrier_wait(&mBarrier);
-        /** PHASE 01 */
-        while (1)
-        {
-            pthread_mutex_lock(&mPendingDocs_mutex);
-            while (mPendingDocs.empty() && mPhase<PH_02 )
-                pthread_cond_wait(&mPendingDocs_cond, &mPendingDocs_mutex);
+        /** PHASE 01: Parse documents until the next batch is ready */
+        Batch *batch = NextBatch(myThreadId, seq);
 
-            if (mPendingDocs.empty() || mPhase==PH_FINISHED) {
-                pthread_cond_broadcast(&mPendingDocs_cond);
-                pthread_mutex_unlock(&mPendingDocs_mutex);
-                break;
-            }
+        /* Finish detected, thread should exit. */
+        if (!batch) break;
+
+        /** PHASE 02 */
+        if (myThreadId==0) Prepare(*batch);
+        Sync(myThreadId, batch->threads);
+
+        PrepareTasks(*batch, myThreadId);
+        Sync(myThreadId, batch->threads);
+
+        Intersect(myThreadId);
+        Sync(myThreadId, batch->threads);
+
+        Match(*batch, myThreadId);
+        Sync(myThreadId, batch->threads);
+
+        /* Batch completed */
+        if (myThreadId==0) {
+            mBatchWords.clear();
 
-            /* Get a document from the pending list */
-            Document doc (mPendingDocs.front());
-            mPendingDocs.pop();
+            pthread_mutex_lock(&mPendingDocs_mutex);
+            mBatches.pop_front();
+            mBatchSeq++;
             pthread_cond_broadcast(&mPendingDocs_cond);
             pthread_mutex_unlock(&mPendingDocs_mutex);
+            mWorkEvent.notifyAll();
 
-            /* Parse the document and append it to mParsedDocs */
-            ParseDoc(doc, myThreadId);
-            pthread_mutex_lock(&mParsedDocs_mutex);
-            mParsedDocs.push_back(doc);
-            pthread_mutex_unlock(&mParsedDocs_mutex);
+            /* Wake GetNextAvailRes, which may now seal the next batch. */
+            mReadyEvent.notifyAll();
         }
+    }
 
-        /* Finish detected, thread should exit. */
-        if (mPhase == PH_FINISHED) break;
-        pthread_barrier_wait(&mBarrier);
+    return NULL;
+}
 
-        /** PHASE 01 */
-        if (myThreadId==0) Prepare();
-        pthread_barrier_wait(&mBarrier);
+/**
+ * Returns the batch with sequence number `seq` once it is sealed and
+ * parsed, parsing pending documents meanwhile. Batches matched without
+ * this thread are skipped, advancing `seq`. Returns NULL on finish.
+ * The work since the last Sync and the parsing count as busy; waiting
+ * for documents counts as neither busy nor idle.
+ */
+Batch* NextBatch(long thread_id, unsigned &seq)
+{
+    ThreadTimes &tt = mThreadTimes[thread_id];
+    unsigned long parsing = 0;
+    tt.busy += Now() - tt.mark;
+
+    Batch *batch = NULL;
+    while (1) {
+        unsigned key = mWorkEvent.prepareWait();
+        bool finished;
+
+        pthread_mutex_lock(&mPendingDocs_mutex);
+        if (mBatchSeq==seq && mBatches.front().runnable()) {
+            Batch &front = mBatches.front();
+            if (!front.threads) front.threads = BatchThreads(front);
+            if ((unsigned) thread_id < front.threads) batch = &front;
+            else seq++;
+            pthread_mutex_unlock(&mPendingDocs_mutex);
+            mWorkEvent.cancelWait();
+            if (batch) break;
+            continue;
+        }
+        /* Nobody calls GetNextAvailRes to seal batches for the callback, so do it when idle. */
+        if (mResultCallback && mBatches.size()==1 && mBatches.back().numDocs) SealBatch();
+        finished = mFinished;
+        pthread_mutex_unlock(&mPendingDocs_mutex);
+
+        Document doc;
+        if (mPendingDocs.pop(doc)) {
+            mWorkEvent.cancelWait();
+            unsigned long p = Now();
+            ParsePending(doc, thread_id);
+            parsing += Now() - p;
+        }
+        else if (finished) { mWorkEvent.cancelWait(); break; }
+        else mWorkEvent.wait(key);
+    }
+    tt.mark = Now();
+    tt.busy += parsing;
+    return batch;
+}
 
-        Intersect(myThreadId);
-        pthread_barrier_wait(&mBarrier);
+/**
+ * How many threads should match `batch`: all of them, or in adaptive mode
+ * one per ADAPTIVE_WORDS_PER_THREAD document words, since for small
+ * batches the barriers cost more than the extra threads save.
+ */
+unsigned BatchThreads(Batch &batch)
+{
+    if (!mAdaptive) return mNumThreads;
+    unsigned long words = 0;
+    for (unsigned d=0 ; d<batch.numDocs ; d++) words += batch.docs[d].words->indexVec.size();
+    return min((unsigned long) mNumThreads, 1 + words/ADAPTIVE_WORDS_PER_THREAD);
+}
 
-        Match(myThreadId);
-        pthread_barrier_wait(&mBarrier);
+/**
+ * Barrier of the `threads` threads that match the current batch. Instead of sleeping, a thread that waits
+ * parses the documents of the following batches, which overlaps their
+ * parsing with the matching of the current one.
+ */
+void Sync(long thread_id, unsigned threads)
+{
+    ThreadTimes &tt = mThreadTimes[thread_id];
+    unsigned long arrived = Now(), parsing = 0;
+    tt.busy += arrived - tt.mark;
+
+    unsigned gen = __atomic_load_n(&mSyncGen, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&mSyncCount, 1, __ATOMIC_ACQ_REL) == threads) {
+        __atomic_store_n(&mSyncCount, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&mSyncGen, 1, __ATOMIC_RELEASE);
+        mWorkEvent.notifyAll();
+    }
+    else while (1) {
+        unsigned key = mWorkEvent.prepareWait();
+        Document doc;
+        if (__atomic_load_n(&mSyncGen, __ATOMIC_ACQUIRE) != gen) { mWorkEvent.cancelWait(); break; }
+        if (mPendingDocs.pop(doc)) {
+            mWorkEvent.cancelWait();
+            unsigned long p = Now();
+            ParsePending(doc, thread_id);
+            parsing += Now() - p;
+        }
+        else mWorkEvent.wait(key);
+    }
 
-        /* Batch completed */
-        if (myThreadId==0) {
-            mParsedDocs.clear();
-            mBatchWords.clear();
+    tt.mark = Now();
+    tt.busy += parsing;
+    tt.idle += tt.mark - arrived - parsing;
+}
+
+/** Parses a pending document into its slot of the batch, waking the threads if that completes a sealed batch. */
+void ParsePending(Document &doc, long thread_id)
+{
+    ParseDoc(doc, thread_id);
+
+    Batch &batch = *doc.batch;
+    batch.docs[doc.seq - batch.firstSeq] = doc;
+    unsigned parsed = __atomic_add_fetch(&batch.parsed, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&batch.sealed, __ATOMIC_SEQ_CST) && parsed == __atomic_load_n(&batch.numDocs, __ATOMIC_SEQ_CST))
+        mWorkEvent.notifyAll();
+}
+
+/** Makes a matched document available to the consumers. */
+void PushReady(Document &doc)
+{
+    if (__atomic_load_n(&mReadyOverflowSize, __ATOMIC_ACQUIRE) || !mReadyDocs.push(doc)) {
+        pthread_mutex_lock(&mReadyOverflow_mutex);
+        mReadyOverflow.push(doc);
+        __atomic_add_fetch(&mReadyOverflowSize, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&mReadyOverflow_mutex);
+    }
+    mReadyEvent.notifyOne();
+}
+
+/**
+ * Takes a ready document, if there is one. Documents go to mReadyOverflow
+ * only while it is not empty, so taking it after mReadyDocs keeps their order.
+ */
+bool TryPopReady(Document &doc)
+{
+    if (__atomic_load_n(&mHeld, __ATOMIC_ACQUIRE) || __atomic_load_n(&mReadyOverflowSize, __ATOMIC_ACQUIRE)) {
+        bool found = false;
+        pthread_mutex_lock(&mReadyOverflow_mutex);
+        if (mHeld) { doc = mHeldDoc; mHeld = false; found = true; }
+        pthread_mutex_unlock(&mReadyOverflow_mutex);
+        if (found) return true;
+    }
+    if (mReadyDocs.pop(doc)) return true;
+    if (!__atomic_load_n(&mReadyOverflowSize, __ATOMIC_ACQUIRE)) return false;
+
+    bool found = false;
+    pthread_mutex_lock(&mReadyOverflow_mutex);
+    if (!mReadyOverflow.empty()) {
+        doc = mReadyOverflow.front();
+        mReadyOverflow.pop();
+        __atomic_sub_fetch(&mReadyOverflowSize, 1, __ATOMIC_RELEASE);
+        found = true;
+    }
+    pthread_mutex_unlock(&mReadyOverflow_mutex);
+    return found;
+}
+
+/**
+ * Waits until a document is ready and takes it, sealing the documents
+ * submitted so far into a batch when nothing is in flight.
+ */
+Document PopReady()
+{
+    Document doc;
+    while (!TryPopReady(doc)) {
+        unsigned key = mReadyEvent.prepareWait();
+        if (TryPopReady(doc)) { mReadyEvent.cancelWait(); break; }
+
+        pthread_mutex_lock(&mPendingDocs_mutex);
+        if (mBatches.size()==1 && mBatches.back().numDocs) SealBatch();
+        pthread_mutex_unlock(&mPendingDocs_mutex);
+        mReadyEvent.wait(key);
+    }
+    return doc;
+}
+
+/**
+ * Hands a matched document to the callback or the ready queue. In ordered
+ * mode it waits in mReorderDocs for the documents submitted before it.
+ * Must be called with mReadyDocs_mutex held, unless both modes are off;
+ * the callback too runs under that lock, serializing the workers.
+ */
+void Deliver(Document &doc)
+{
+    if (mInOrder && doc.seq != mDeliverSeq) { mReorderDocs.push(doc); return; }
+
+    Document next = doc;
+    while (1) {
+        if (mResultCallback) {
+            mResultCallback(next.id, next.matchingQueries->size(), next.matchingQueries->data(), mResultArg);
+            mDocPool.put(next);
         }
+        else PushReady(next);
+        if (!mInOrder) return;
 
+        mDeliverSeq++;
+        if (mReorderDocs.empty() || mReorderDocs.top().seq != mDeliverSeq) break;
+        next = mReorderDocs.top();
+        mReorderDocs.pop();
     }
+}
 
-    return NULL;
+/** Closes the last batch and opens a new one. Must be called with mPendingDocs_mutex held. */
+void SealBatch()
+{
+    __atomic_store_n(&mBatches.back().sealed, true, __ATOMIC_SEQ_CST);
+    mBatches.emplace_back(mDocSeq);
+    mWorkEvent.notifyAll();
 }
 
-/** Parse the space separated words and discard duplicates */
-void ParseDoc(Document &doc, const long thread_id)
+/** Queues a query change behind the documents submitted so far. */
+void QueueQuery(QueryID query_id, const Query &q)
+{
+    pthread_mutex_lock(&mPendingDocs_mutex);
+    if (mBatches.back().numDocs) SealBatch();
+    mBatches.back().queries.emplace_back(query_id, q);
+    pthread_mutex_unlock(&mPendingDocs_mutex);
+}
+
+/** Applies a queued query change to the query structures. */
+void ApplyQuery(QueryID query_id, const Query &q)
+{
+    if (mActiveQueries.size() < query_id+1)
+        mActiveQueries.resize(query_id+1);
+    Query &Q = mActiveQueries[query_id];
+
+    /* End the query, or the one that had the same id */
+    if (Q.numWords) {
+        vector<QueryID> &filed = mQWQueries[Q.type][Q.words[(int) Q.key]->qwindex[Q.type]];
+        *find(filed.begin(), filed.end(), query_id) = filed.back();
+        filed.pop_back();
+
+        if (Q.type!=MT_EXACT_MATCH)
+            for (int i=0 ; i<Q.numWords ; i++) ReleaseQueryWord(Q.words[i], Q.type);
+        Q.numWords = 0;
+        mNumQueries--;
+    }
+    if (!q.numWords) return;
+
+    if (q.type!=MT_EXACT_MATCH)
+        for (int i=0 ; i<q.numWords ; i++) AcquireQueryWord(q.words[i], q.type);
+
+    Q = q;
+    Q.key = KeyWord(q);
+    Word *kw = q.words[(int) Q.key];
+    if (kw->qwindex[q.type] < 0) kw->qwindex[q.type] = mQWQueries[q.type].size();
+    if (mQWQueries[q.type].size() <= (unsigned) kw->qwindex[q.type])
+        mQWQueries[q.type].resize(kw->qwindex[q.type]+1);
+    mQWQueries[q.type][kw->qwindex[q.type]].push_back(query_id);
+    mNumQueries++;
+}
+
+/**
+ * The word to file query `q` under: the one seen in the fewest batches so
+ * far, as a rare word is rarely satisfied, or the longest on a tie. Match
+ * then only visits the query for documents where that word is satisfied.
+ */
+int KeyWord(const Query &q)
+{
+    int key = 0;
+    for (int i=1 ; i<q.numWords ; i++) {
+        Word *w = q.words[i], *k = q.words[key];
+        if (w->batchFreq < k->batchFreq || (w->batchFreq == k->batchFreq && w->length > k->length)) key = i;
+    }
+    return key;
+}
+
+/**
+ * Adds a reference to `nw` as a query word of type `mt`. A new word, or
+ * one whose entry has been tombstoned, gets a new entry in the tables,
+ * unless the tombstone is in the slice being prepared: that one is revived
+ * so that the slice never holds the same word twice.
+ */
+void AcquireQueryWord(Word *nw, MatchType mt)
 {
-    WordText wtxt;
-    const char *c2;
-    int i;
-    Word* nw;
+    if (mQWHash[mt-1].insert(nw->wid)) {
+        nw->qwindex[mt] = mQWHash[mt-1].size()-1;
+        mQWRefs[mt-1].push_back(0);
+        if (mt==MT_EDIT_DIST) mQWEditPos.push_back(0);
+        else mQWHammPos.emplace_back(0, 0);
+    }
 
-    c2 = doc.str-1;
-    do {
-        for (unsigned wi=0; wi<WUNITS_MAX; wi++) wtxt.ints[wi]=0;
-        i=0; do {wtxt.chars[i++] = *++c2;} while (*c2!=' ' && *c2 );
-        wtxt.chars[--i] = 0;
+    unsigned qwi = nw->qwindex[mt];
+    if (mQWRefs[mt-1][qwi]++) return;
 
-        GWDB.insert(wtxt, &nw);
-        doc.words->insert(nw->wid);
+    if (mt==MT_EDIT_DIST) {
+        unsigned pos = mQWEditPos[qwi];
+        if (pos >= mQWEditSlice.back() && pos < mQWEdit.size() && mQWEdit.qwindex[pos]==qwi && mQWEdit.dead[pos]) {
+            mQWEdit.dead[pos] = false;
+            mQWDead[mt-1]--;
+            return;
+        }
+        mQWEditPos[qwi] = mQWEdit.size();
+        mQWEdit.push_back(nw, qwi);
+    }
+    else {
+        QWHammBucket &bucket = mQWHamm[mBatchId][nw->length];
+        if (mQWHammPos[qwi].first==mBatchId && mQWHammPos[qwi].second < bucket.size()
+                && bucket.qwindex[mQWHammPos[qwi].second]==qwi && bucket.dead[mQWHammPos[qwi].second]) {
+            bucket.dead[mQWHammPos[qwi].second] = false;
+            mQWDead[mt-1]--;
+            return;
+        }
+        mQWHammPos[qwi] = make_pair(mBatchId, bucket.size());
+        bucket.push_back(nw, qwi);
+        mQWHammEntries++;
+    }
+}
 
-    } while (*c2);
+/** Drops a reference to the query word `nw`, tombstoning its entry when none is left. */
+void ReleaseQueryWord(Word *nw, MatchType mt)
+{
+    unsigned qwi = nw->qwindex[mt];
+    if (--mQWRefs[mt-1][qwi]) return;
 
+    if (mt==MT_EDIT_DIST) mQWEdit.dead[mQWEditPos[qwi]] = true;
+    else mQWHamm[mQWHammPos[qwi].first][nw->length].dead[mQWHammPos[qwi].second] = true;
+    mQWDead[mt-1]++;
 }
 
-/** Prepare the necessary structures for the intersection */
-void Prepare()
+/**
+ * Drops the tombstoned entries of mQWEdit, keeping the batch slices in
+ * order, and rebuilds everything that refers to positions: the slice
+ * starts, the common prefixes, mQWEditPos and the trie/FastSS index. The
+ * last slice is the one being prepared, which is indexed later as usual.
+ */
+void CompactEdit()
 {
-    sort(mQWEdit.begin()+mQWLastEdit, mQWEdit.end(), ltw);
+    vector<unsigned> slice(mQWEditSlice.size());
+    unsigned out=0, b=0;
+    for (unsigned j=0 ; j<mQWEdit.size() ; j++) {
+        while (b<slice.size() && mQWEditSlice[b]==j) slice[b++] = out;
+        if (!mQWEdit.dead[j]) mQWEdit.move(out++, j);
+    }
+    while (b<slice.size()) slice[b++] = out;
+    mQWEdit.truncate(out);
+    mQWEditSlice.swap(slice);
+    mQWDead[MT_EDIT_DIST-1] = 0;
+
+    mQWEditTrie.clear();
+    mQWEditFastSS.clear();
+    for (unsigned j=0 ; j<mQWEdit.size() ; j++) mQWEditPos[mQWEdit.qwindex[j]] = j;
+
+    if (mEditEngine==EE_SCAN) {
+        mQWEditLens.clear();
+        for (b=0 ; b+1<mQWEditSlice.size() ; b++) {
+            unsigned j = mQWEditSlice[b];
+            for (unsigned l=0 ; l<EDIT_LENGTHS ; l++) {
+                while (j<mQWEditSlice[b+1] && mQWEdit.length[j] < l+MIN_WORD_LENGTH) j++;
+                mQWEditLens.push_back(j);
+            }
+            mQWEditLens.push_back(mQWEditSlice[b+1]);
+        }
+    }
 
-    if (mQWEdit.size() > mQWLastEdit+1) {
-        char *s0 = mQWEdit[mQWLastEdit].txt.chars;
-        for (unsigned j=mQWLastEdit+1; j<mQWEdit.size() ; j++) {
-            char *s1 = mQWEdit[j].txt.chars;
+    for (b=0 ; b+1<mQWEditSlice.size() ; b++) {
+        for (unsigned j=mQWEditSlice[b] ; j<mQWEditSlice[b+1] ; j++) {
             unsigned i=0;
-            while (s0[i] == s1[i]) i++;
-            mQWEdit[j].common_prefix = i;
-            s0=s1;
+            if (j>mQWEditSlice[b])
+                while (i<mQWEdit.length[j] && mQWEdit.txt[j-1].chars[i] == mQWEdit.txt[j].chars[i]) i++;
+            mQWEdit.prefix[j] = i;
+
+            if (mEditEngine==EE_TRIE) mQWEditTrie.insert(mQWEdit, j, b+1);
+            else if (mEditEngine==EE_FASTSS) mQWEditFastSS.insert(mQWEdit, j);
         }
     }
-    mQWLastEdit = mQWEdit.size();
+}
+
+/**
+ * Walks the dictionary and drops from the match lists the query words that
+ * no active query has any more. Over budget, it also evicts the match lists
+ * of the words seen least recently, down to 3/4 of the budget; such a word
+ * is compared with every live query word again when it comes back. The
+ * words seen in a single batch go first: in a Zipfian stream most of them
+ * never come back, while the recurring ones keep coming.
+ */
+void CollectMatches()
+{
+    unsigned cutoff[2] = {0, 0};    /* Evict if last seen before, by whether the word recurs */
+    if (mMatchMemory > mMatchBudget) {
+        vector<unsigned long> by_seen[2] { vector<unsigned long>(mBatchId+1), vector<unsigned long>(mBatchId+1) };
+        for (unsigned wid=0 ; wid<GWDB.size() ; wid++) {
+            Word *w = GWDB.getWord(wid);
+            if (w) by_seen[w->batchFreq > 1][w->lastSeen] += w->editMatches.memory() + w->hammMatches.memory();
+        }
+        unsigned long left = mMatchMemory;
+        for (int r=0 ; r<2 ; r++)
+            while (cutoff[r] < mBatchId && left > mMatchBudget/4*3) left -= by_seen[r][cutoff[r]++];
+    }
+
+    auto deadE = [](unsigned qw) { return !mQWRefs[MT_EDIT_DIST-1][qw]; };
+    auto deadH = [](unsigned qw) { return !mQWRefs[MT_HAMMING_DIST-1][qw]; };
+    unsigned long memory = 0;
+    for (unsigned wid=0 ; wid<GWDB.size() ; wid++) {
+        Word *w = GWDB.getWord(wid);
+        if (!w) continue;
+        if (w->lastSeen < cutoff[w->batchFreq > 1] && (w->editMatches.size() || w->hammMatches.size())) {
+            w->editMatches.clear();
+            w->hammMatches.clear();
+            w->lastCheck_edit = w->lastCheck_hamm = 0;
+            mMatchEvictions++;
+        }
+        w->editMatches.removeIf(deadE);
+        w->hammMatches.removeIf(deadH);
+        memory += w->editMatches.memory() + w->hammMatches.memory();
+    }
+    mMatchMemory = memory;
+}
 
-    for (int len=MIN_WORD_LENGTH; len<=MAX_WORD_LENGTH; len++)
-        sort (mQWHamm[mBatchId][len].begin(), mQWHamm[mBatchId][len].end(), ltwh);
+/** Drops the tombstoned entries of mQWHamm and rebuilds mQWHammPos and the segment index. */
+void CompactHamm()
+{
+    mQWHammSeg.clear();
+    mQWHammEntries = 0;
+    for (unsigned b=0 ; b<=mBatchId ; b++) {
+        for (int len=MIN_WORD_LENGTH; len<=MAX_WORD_LENGTH; len++) {
+            QWHammBucket &bucket = mQWHamm[b][len];
+            vector<unsigned> live;
+            for (unsigned pos=0 ; pos<bucket.size() ; pos++)
+                if (!bucket.dead[pos]) live.push_back(pos);
+            bucket.permute(live);
+            for (unsigned pos=0 ; pos<bucket.size() ; pos++)
+                mQWHammPos[bucket.qwindex[pos]] = make_pair(b, pos);
+            mQWHammEntries += bucket.size();
+            if (b<mBatchId) mQWHammSeg.insert(bucket, len, b);
+        }
+    }
+    mQWDead[MT_HAMMING_DIST-1] = 0;
+}
+
+/** Parse the space separated words and discard duplicates */
+void ParseDoc(Document &doc, const long thread_id)
+{
+    Tokenize(doc.str, [&](const char *w, int len) {
+        WordText wtxt;
+        Word* nw;
+        MakeWordText(w, len, wtxt);
+        GWDB.insert(wtxt, &nw);
+        doc.words->insert(nw->wid);
+    });
+
+}
+
+/**
+ * Prepare the necessary structures for the intersection: the serial part,
+ * which applies the query changes and splits the rest into tasks.
+ */
+void Prepare(Batch &batch)
+{
+    for (auto &bq : batch.queries)
+        ApplyQuery(bq.first, bq.second);
+
+    /* Compact the tables once half their entries are dead, so the cost tracks the live queries. */
+    unsigned dead_edit = mQWDead[MT_EDIT_DIST-1], dead_hamm = mQWDead[MT_HAMMING_DIST-1];
+    bool compact_edit = dead_edit >= QW_COMPACT_MIN && 2*dead_edit > mQWEdit.size();
+    bool compact_hamm = dead_hamm >= QW_COMPACT_MIN && 2*dead_hamm > mQWHammEntries;
+    if (compact_edit) CompactEdit();
+    if (compact_hamm) CompactHamm();
+    if (compact_edit || compact_hamm || mMatchMemory > mMatchBudget) CollectMatches();
+
+    mQWNewEdit = mQWEditSlice.back();
+    mQWLastEdit = mQWEdit.size();
+    mQWEditSlice.push_back(mQWLastEdit);
+    if (mEditEngine==EE_SCAN) BucketEdit();
 
     mBatchId++;
     mQWHamm.resize(mBatchId+1);
 
-    pthread_mutex_lock(&mPendingDocs_mutex);
-    if (mPhase!=PH_FINISHED) mPhase=PH_IDLE;
-    pthread_cond_broadcast(&mPendingDocs_cond);
-    pthread_mutex_unlock(&mPendingDocs_mutex);
+    mBatchWords.reserve(GWDB.size());
+    unsigned edit_tasks = mEditEngine==EE_SCAN ? EDIT_BUCKETS : 1;
+    mPrepareWork.reset(edit_tasks + MAX_WORD_LENGTH-MIN_WORD_LENGTH+1, 1, batch.threads);
+    mGatherWork.reset(batch.numDocs, 4, batch.threads);
+    mMatchWork.reset(batch.numDocs, 1, batch.threads);
+}
+
+/**
+ * The parallel part of Prepare. The tasks are the sorts of the new edit
+ * words, one per length and first letter bucket (or the whole insertion into the
+ * trie/FastSS index), and the sort and indexing of every new Hamming
+ * bucket. Then the threads gather the words of the batch documents into
+ * mBatchWords, and the last one to finish splits them for Intersect.
+ */
+void PrepareTasks(Batch &batch, long thread_id)
+{
+    const unsigned batch_id = mBatchId-1;
+    unsigned edit_tasks = mEditEngine==EE_SCAN ? EDIT_BUCKETS : 1;
+    unsigned lo, hi;
+
+    while (mPrepareWork.next(thread_id, lo, hi))
+    for (unsigned task=lo ; task<hi ; task++)
+    {
+        if (task >= edit_tasks) {
+            int len = MIN_WORD_LENGTH + task - edit_tasks;
+            QWHammBucket &bucket = mQWHamm[batch_id][len];
+            vector<unsigned> order(bucket.size());
+            for (unsigned pos=0 ; pos<bucket.size() ; pos++) order[pos] = pos;
+            sort(order.begin(), order.end(), LTW{bucket.txt});
+            bucket.permute(order);
+            for (unsigned pos=0 ; pos<bucket.size() ; pos++)
+                if (!bucket.dead[pos]) mQWHammPos[bucket.qwindex[pos]] = make_pair(batch_id, pos);
+            mQWHammSeg.insert(bucket, len, batch_id);
+        }
+        else if (mEditEngine==EE_TRIE) {
+            for (unsigned j=mQWNewEdit; j<mQWLastEdit ; j++)
+                mQWEditTrie.insert(mQWEdit, j, mBatchId);
+        }
+        else if (mEditEngine==EE_FASTSS) {
+            for (unsigned j=mQWNewEdit; j<mQWLastEdit ; j++)
+                mQWEditFastSS.insert(mQWEdit, j);
+        }
+        else SortEditBucket(task);
+    }
+
+    vector<unsigned> words;
+    while (mGatherWork.next(thread_id, lo, hi))
+        for (unsigned d=lo ; d<hi ; d++)
+            for (unsigned index : batch.docs[d].words->indexVec)
+                if (mBatchWords.testAndSet(index)) {
+                    Word *w = GWDB.getWord(index);
+                    w->batchFreq++;
+                    w->lastSeen = mBatchId;
+                    words.push_back(index);
+                }
+
+    pthread_mutex_lock(&mBatchWords_mutex);
+    mBatchWords.append(words);
+    if (++mBatchWordsDone == batch.threads) {
+        mBatchWordsDone = 0;
+        mIntersectWork.reset(mBatchWords.size(), 16, batch.threads);
+    }
+    pthread_mutex_unlock(&mBatchWords_mutex);
+}
+
+/**
+ * Groups the new slice of mQWEdit by the length and the first letter of
+ * the words (a counting sort), so that sorting the groups sorts the slice
+ * by length, then text. Records where every length starts.
+ */
+void BucketEdit()
+{
+    unsigned n = mQWLastEdit-mQWNewEdit;
+    vector<unsigned> order(n);
+    for (unsigned k=0 ; k<=EDIT_BUCKETS ; k++) mEditBuckets[k] = 0;
+
+    auto key = [](unsigned j) { return (mQWEdit.length[j]-MIN_WORD_LENGTH)*26 + mQWEdit.txt[j].chars[0]-'a'; };
+    for (unsigned j=mQWNewEdit ; j<mQWLastEdit ; j++) mEditBuckets[key(j)+1]++;
+    for (unsigned k=0 ; k<EDIT_BUCKETS ; k++) mEditBuckets[k+1] += mEditBuckets[k];
+    for (unsigned j=mQWNewEdit ; j<mQWLastEdit ; j++) order[mEditBuckets[key(j)]++] = j;
+    mQWEdit.permute(mQWNewEdit, order);
+
+    /* The scatter advanced every start to the next bucket's start. */
+    for (unsigned k=EDIT_BUCKETS ; k>0 ; k--) mEditBuckets[k] = mEditBuckets[k-1] + mQWNewEdit;
+    mEditBuckets[0] = mQWNewEdit;
+
+    for (unsigned l=0 ; l<=EDIT_LENGTHS ; l++) mQWEditLens.push_back(mEditBuckets[l*26]);
+}
 
-    for (Document &doc : mParsedDocs)
-        for (unsigned index : doc.words->indexVec)
-            mBatchWords.insert(index);
+/** Sorts edit bucket `k` and sets the common prefix of its words with their predecessors. */
+void SortEditBucket(unsigned k)
+{
+    unsigned lo = mEditBuckets[k], hi = mEditBuckets[k+1];
+    if (lo==hi) return;
+    vector<unsigned> order(hi-lo);
+    for (unsigned j=lo ; j<hi ; j++) order[j-lo] = j;
+    sort(order.begin(), order.end(), LTW{mQWEdit.txt});
+    mQWEdit.permute(lo, order);
+
+    /* The word before the bucket starts with another letter, or is of another length and not scanned with it. */
+    mQWEdit.prefix[lo] = 0;
+
+    char *s0 = mQWEdit.txt[lo].chars;
+    for (unsigned j=lo+1; j<hi ; j++) {
+        char *s1 = mQWEdit.txt[j].chars;
+        unsigned i=0;
+        while (s1[i] && s0[i] == s1[i]) i++;
+        mQWEdit.prefix[j] = i;
+        s0=s1;
+    }
 
+    for (unsigned j=lo; j<hi ; j++)
+        if (!mQWEdit.dead[j]) mQWEditPos[mQWEdit.qwindex[j]] = j;
 }
 
 /** For every dword of this batch, update its matching lists */
 void Intersect(long myThreadId)
 {
-    int T[32*32];
-    for (unsigned index = myThreadId ; index < mBatchWords.size() ; index += NUM_THREADS)
+    EditCol C[MAX_WORD_LENGTH+1];
+    unsigned Peq[26];
+    int hd[HAMM_BATCH];
+    vector<unsigned> cand;
+    LetterHist dhist;
+    unsigned long hits=0, misses=0;
+    unsigned lo, hi;
+    while (mIntersectWork.next(myThreadId, lo, hi))
+    for (unsigned index=lo ; index<hi ; index++)
     {
         Word *wd = GWDB.getWord(mBatchWords.indexVec[index]);
 
@@ -350,129 +1479,167 @@ void Intersect(long myThreadId)
         int dn = wd->length;
         unsigned letter_bits = wd->letterBits;
 
-        for (unsigned j=last_check_edit ; j<mQWEdit.size() ; j++) {
-            QWordE &qw = mQWEdit[j];
-            qi=min(qi, qw.common_prefix);
-            if (abs(qw.length - dn)<=3 && Word::letterDiff(letter_bits, qw.letterBits)<=6) {
-                int dist = EditDist(dtxt.chars, dn, qw.txt.chars, qw.length, T, &qi);
-                if (dist<=3) wd->editMatches[dist].push_back(qw.qwindex);
+        unsigned long memory = wd->editMatches.memory() + wd->hammMatches.memory();
+        if (last_check_edit || last_check_hamm) hits++;
+        else misses++;
+        for (int l=0 ; l<26 ; l++) Peq[l] = 0;
+        for (int i=0 ; i<dn ; i++) Peq[dtxt.chars[i]-'a'] |= 1u << i;
+
+        switch (mEditEngine) {
+        case EE_TRIE:
+            /* The trie has no tombstones: dead words are matched until the next compaction, but never used. */
+            mQWEditTrie.search(Peq, dn, letter_bits, last_check_edit, wd->editMatches);
+            break;
+        case EE_FASTSS:
+            cand.clear();
+            mQWEditFastSS.search(dtxt, dn, mQWEditSlice[last_check_edit], cand);
+            sort(cand.begin(), cand.end());
+            cand.erase(unique(cand.begin(), cand.end()), cand.end());
+            for (unsigned j : cand) {
+                if (mQWEdit.dead[j]) continue;
+                qi=0;
+                int dist = EditDist(Peq, dn, mQWEdit.txt[j].chars, mQWEdit.length[j], C, &qi);
+                if (dist<=3) wd->editMatches.add(mQWEdit.qwindex[j], dist);
+            }
+            break;
+        default:
+            /* Only the lengths within 3, and only the words whose letter counts allow distance 3. */
+            MakeLetterHist(dtxt.chars, dn, dhist);
+            for (unsigned b=last_check_edit ; b+1<mQWEditSlice.size() ; b++) {
+                const unsigned *lens = &mQWEditLens[b*(EDIT_LENGTHS+1)];
+                for (int l=max(dn-3, MIN_WORD_LENGTH) ; l<=min(dn+3, MAX_WORD_LENGTH) ; l++) {
+                    unsigned limit = 7 - abs(l-dn);
+                    qi=0;
+                    for (unsigned j=lens[l-MIN_WORD_LENGTH] ; j<lens[l-MIN_WORD_LENGTH+1] ; j++) {
+                        qi=min(qi, (unsigned) mQWEdit.prefix[j]);
+                        if (LetterHistDiff(dhist, mQWEdit.hist[j]) <= limit && !mQWEdit.dead[j]) {
+                            int dist = EditDist(Peq, dn, mQWEdit.txt[j].chars, l, C, &qi);
+                            if (dist<=3) wd->editMatches.add(mQWEdit.qwindex[j], dist);
+                        }
+                    }
+                }
             }
-
         }
 
-        wd->lastCheck_edit = mQWEdit.size();
-        for (unsigned j=last_check_hamm ; j<mBatchId ; j++) {
-            for (QWordH &qw : mQWHamm[j][dn]) {
-                if (Word::letterDiff(letter_bits, qw.letterBits)<=6) {
-                    int dist = HammingDist(dtxt.chars, qw.txt.chars);
-                    if (dist<=3) wd->hammMatches[dist].push_back(qw.qwindex);
-                }
+        wd->lastCheck_edit = mBatchId;
+        if (HammingSegIndex::indexed(dn)) mQWHammSeg.search(dtxt, dn, last_check_hamm, mQWHamm, wd->hammMatches);
+        else for (unsigned j=last_check_hamm ; j<mBatchId ; j++) {
+            QWHammBucket &bucket = mQWHamm[j][dn];
+            for (unsigned b=0 ; b<bucket.size() ; b+=HAMM_BATCH) {
+                unsigned n = min((unsigned) HAMM_BATCH, bucket.size()-b);
+                HammingBatch(dtxt, &bucket.txt[b], n, hd);
+                for (unsigned k=0 ; k<n ; k++)
+                    if (hd[k]<=3 && !bucket.dead[b+k]) wd->hammMatches.add(bucket.qwindex[b+k], hd[k]);
             }
         }
         wd->lastCheck_hamm = mBatchId;
+
+        memory = wd->editMatches.memory() + wd->hammMatches.memory() - memory;
+        if (memory) __atomic_add_fetch(&mMatchMemory, memory, __ATOMIC_RELAXED);
     }
+    __atomic_add_fetch(&mMatchHits, hits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mMatchMisses, misses, __ATOMIC_RELAXED);
 }
 
-/** Determine the matches and deliver the results */
-void Match(long myThreadId)
+/**
+ * Determine the matches and deliver the results. Only the queries filed
+ * under a word that the document satisfies are visited, each at most once.
+ */
+void Match(Batch &batch, long myThreadId)
 {
-    char* qwH = (char*) malloc(mQWHash[MT_HAMMING_DIST-1].size());
-    char* qwE = (char*) malloc(mQWHash[MT_EDIT_DIST-1].size());
-
-    for (unsigned index=myThreadId ; index < mParsedDocs.size() ; index += NUM_THREADS)
+    DistBits &bitsE = mMatchBits[2*myThreadId];
+    DistBits &bitsH = mMatchBits[2*myThreadId+1];
+    bitsE.reserve(mQWHash[MT_EDIT_DIST-1].size());
+    bitsH.reserve(mQWHash[MT_HAMMING_DIST-1].size());
+
+    unsigned lo, hi;
+    while (mMatchWork.next(myThreadId, lo, hi))
+    for (unsigned index=lo ; index<hi ; index++)
     {
-        Document &doc = mParsedDocs[index];
-
-        for (unsigned i=0 ; i<mQWHash[MT_EDIT_DIST-1].size() ; i++) qwE[i] = 10;
-        for (unsigned i=0 ; i<mQWHash[MT_HAMMING_DIST-1].size() ; i++) qwH[i] = 10;
+        Document &doc = batch.docs[index];
 
         for (unsigned index : doc.words->indexVec) {
             Word *wd = GWDB.getWord(index);
-            for (int k=3 ; k>=0 ; k--) {
-                for (unsigned qw : wd->editMatches[k]) if (k < qwE[qw]) qwE[qw] = k;
-                for (unsigned qw : wd->hammMatches[k]) if (k < qwH[qw]) qwH[qw] = k;
-            }
+            for (unsigned m : wd->editMatches) bitsE.set(MatchList::qwindex(m), MatchList::dist(m));
+            for (unsigned m : wd->hammMatches) bitsH.set(MatchList::qwindex(m), MatchList::dist(m));
         }
 
-        for (unsigned qid=0 ; qid<mActiveQueries.size() ; qid++) {
-            Query &Q = mActiveQueries[qid];
-            if (Q.numWords==0) continue;
+        /* Verifies the queries filed under a word that is satisfied with distance `d` */
+        auto visit = [&](const vector<QueryID> &filed, int d) {
+            for (QueryID qid : filed) {
+                Query &Q = mActiveQueries[qid];
+                if (d > Q.dist) continue;
 
-            int qwc=0;
+                int qwc=0;
 
-            if (Q.type==MT_EXACT_MATCH)
-            {
-                for (int qwi=0 ; qwi<Q.numWords ; qwi++) {
+                if (Q.type==MT_EXACT_MATCH)
+                {
+                    for (int qwi=0 ; qwi<Q.numWords ; qwi++) {
 
-                    if (doc.words->exists(Q.words[qwi]->wid)) {
-                        ++qwc;
+                        if (doc.words->exists(Q.words[qwi]->wid)) {
+                            ++qwc;
+                        }
+                        else break;
                     }
-                    else break;
                 }
+                else
+                {
+                    DistBits &bits = Q.type==MT_EDIT_DIST ? bitsE : bitsH;
+                    for (int qwi=0 ; qwi<Q.numWords ; qwi++)
+                        if (bits.test(Q.words[qwi]->qwindex[Q.type], Q.dist)) ++qwc;
+                        else break;
+                }
+
+                if (qwc == Q.numWords) doc.matchingQueries->push_back(qid);
             }
-            else
-            {
-                char *qwVec = Q.type==MT_EDIT_DIST ? qwE : qwH;
-                for (int qwi=0 ; qwi<Q.numWords ; qwi++)
-                    if ( qwVec[Q.words[qwi]->qwindex[Q.type]] <= Q.dist) ++qwc;
-                    else break;
-            }
+        };
 
-            if (qwc == Q.numWords) doc.matchingQueries->push_back(qid);
+        vector<vector<QueryID> > &exact = mQWQueries[MT_EXACT_MATCH];
+        for (unsigned index : doc.words->indexVec) {
+            int qwi = GWDB.getWord(index)->qwindex[MT_EXACT_MATCH];
+            if (qwi >= 0) visit(exact[qwi], 0);
         }
-
-        pthread_mutex_lock(&mReadyDocs_mutex);
-        mReadyDocs.push(doc);
-        pthread_cond_broadcast(&mReadyDocs_cond);
-        pthread_mutex_unlock(&mReadyDocs_mutex);
+        bitsE.forEach([&](unsigned qw, int d) {
+            if (qw < mQWQueries[MT_EDIT_DIST].size()) visit(mQWQueries[MT_EDIT_DIST][qw], d);
+        });
+        bitsH.forEach([&](unsigned qw, int d) {
+            if (qw < mQWQueries[MT_HAMMING_DIST].size()) visit(mQWQueries[MT_HAMMING_DIST][qw], d);
+        });
+        bitsE.clear();
+        bitsH.clear();
+
+        sort(doc.matchingQueries->begin(), doc.matchingQueries->end());
+
+        if (mInOrder || mResultCallback) {
+            pthread_mutex_lock(&mReadyDocs_mutex);
+            Deliver(doc);
+            pthread_mutex_unlock(&mReadyDocs_mutex);
+        }
+        else Deliver(doc);
     }
-
-    free(qwE);
-    free(qwH);
 }
 
-int EditDist(char *ds, int dn, char *qs, unsigned qn, int *T, unsigned *qi)
+/**
+ * Bit-parallel edit distance (Myers/Hyyro). The dword is the pattern; its
+ * `Peq` masks are built once by the caller. Every column of the matrix is
+ * kept in `C` as vertical +1/-1 deltas, so the columns of a shared query
+ * prefix are reused via `qi`, exactly as the rows of the full DP table were.
+ * Returns 4 as soon as the diagonal that ends on (dn,qn) exceeds 3.
+ */
+int EditDist(const unsigned *Peq, int dn, char *qs, unsigned qn, EditCol *C, unsigned *qi)
 {
-    int di, ret=0x7F;
+    const unsigned mask = (1u << dn) - 1;
     int diag_di=*qi+dn-qn;
-    int *L = T+(*qi)*(dn+1);
 
-    if (!(*qi)) for(di=0;di<=dn;di++) T[di]=di;
-    else if (diag_di>0 && L[diag_di]>3) return 4;
+    if (!(*qi)) { C[0].VP = mask; C[0].VN = 0; }
+    else if (diag_di>0 && EditCol::cell(C[*qi], *qi, diag_di)>3) return 4;
 
     for((*qi)++;(*qi)<=qn;(*qi)++)
     {
         diag_di++;
-        L+=(dn+1);
-        L[0]=(*qi);
-
-        for(di=1;di<=dn;di++)
-        {
-            L[di]=0x7F;
-            ret =    L [di-dn-1]  +1;
-            int d2 = L [di-1] +1;
-            int d3 = L [di-dn-2]; if(qs[(*qi)-1]!=ds[di-1]) d3++;
-            if(d2<ret) ret=d2;
-            if(d3<ret) ret=d3;
-            L[di]=ret;
-        }
-
-        if ((diag_di)>0 && L[diag_di]>3) return 4;
-    }
-
-    return ret;
-}
-
-int HammingDist(char *ds, char *qs)
-{
-    int num_mismatches = 0;
-    int qi=0;
-
-    while(qs[qi]) {
-        if(ds[qi]!=qs[qi]) num_mismatches++;
-        qi++;
-        if (num_mismatches>3) return num_mismatches;
+        C[*qi] = C[(*qi)-1].advance(Peq[qs[(*qi)-1]-'a']);
+        if ((diag_di)>0 && EditCol::cell(C[*qi], *qi, diag_di)>3) return 4;
     }
 
-    return num_mismatches;
+    return EditCol::cell(C[qn], qn, dn);
 }
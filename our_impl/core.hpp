@@ -7,40 +7,284 @@ struct Query
     Word*           words[MAX_QUERY_WORDS];
     MatchType       type;
     char            dist;
+    char            key;            ///< The word the query is filed under in the inverted index.
 };
 
+struct Batch;
+
 struct Document
 {
     DocID           id;
+    unsigned long   seq;            ///< Position in MatchDocument order.
+    Batch           *batch;
     char            *str;
-    IndexHashTable  *words;
+    unsigned        strCapacity;
+    WordSet         *words;         ///< The distinct word ids.
     vector<QueryID> *matchingQueries;
 };
 
-struct QWordE {
-    int length;
-    unsigned letterBits;
-    unsigned common_prefix;
-    WordText txt;
-    unsigned qwindex;
+/** Orders a priority_queue of documents by MatchDocument order, earliest on top. */
+struct LaterDoc {
+    bool operator()(const Document &d1, const Document &d2) const { return d1.seq > d2.seq; }
+};
+
+/**
+ * Recycles delivered documents: their text buffer, word table and result
+ * vector are kept and reused by the next MatchDocument, so ingesting a
+ * document normally costs no allocation at all.
+ */
+class DocumentPool
+{
+    vector<Document>    docs;
+    pthread_mutex_t     mutex;
+
+public:
+    DocumentPool () { pthread_mutex_init(&mutex, NULL); }
+
+    /**
+     * Returns a document holding a copy of `str`, with TOKEN_PAD bytes to
+     * spare, or one with a NULL `str` if out of memory.
+     */
+    Document get (DocID id, const char *str) {
+        Document doc;
+        pthread_mutex_lock(&mutex);
+        if (docs.empty()) {
+            pthread_mutex_unlock(&mutex);
+            doc.str = NULL;
+            doc.strCapacity = 0;
+            doc.words = new WordSet();
+            doc.matchingQueries = new vector<QueryID>();
+        }
+        else {
+            doc = docs.back();
+            docs.pop_back();
+            pthread_mutex_unlock(&mutex);
+        }
+
+        unsigned len = strlen(str)+1;
+        if (len+TOKEN_PAD > doc.strCapacity) {
+            char *nstr = (char*) realloc(doc.str, len+TOKEN_PAD);
+            if (!nstr) { put(doc); doc.str = NULL; return doc; }
+            doc.str = nstr;
+            doc.strCapacity = len+TOKEN_PAD;
+        }
+        memcpy(doc.str, str, len);
+        memset(doc.str+len, 0, TOKEN_PAD);
+        doc.id = id;
+        return doc;
+    }
+
+    void put (Document &doc) {
+        doc.words->clear();
+        doc.matchingQueries->clear();
+        pthread_mutex_lock(&mutex);
+        docs.push_back(doc);
+        pthread_mutex_unlock(&mutex);
+    }
+
+};
+
+/**
+ * The documents of a batch, in submission order. Chunk k holds 64<<k
+ * slots and is never moved, so threads can fill the slots of chunks that
+ * exist without a lock; only reserve() must be serialized.
+ */
+class DocSlots
+{
+    enum { FIRST = 64, CHUNKS = 26 };
+    Document*   chunks[CHUNKS];
+
+    static unsigned chunkOf (unsigned i) { return 31 - __builtin_clz(i/FIRST + 1); }
+
+public:
+    DocSlots () { memset(chunks, 0, sizeof(chunks)); }
+
+    ~DocSlots () { for (unsigned k=0 ; k<CHUNKS ; k++) delete[] chunks[k]; }
+
+    DocSlots (const DocSlots&) = delete;
+    DocSlots& operator= (const DocSlots&) = delete;
+
+    /** Makes sure slot `i` exists. */
+    void reserve (unsigned i) {
+        unsigned k = chunkOf(i);
+        if (!chunks[k]) chunks[k] = new Document[FIRST << k];
+    }
+
+    Document& operator[] (unsigned i) {
+        unsigned k = chunkOf(i);
+        return chunks[k][i - FIRST*((1u << k) - 1)];
+    }
+
+};
+
+/**
+ * The documents submitted between two query changes. Its queued
+ * StartQuery/EndQuery calls are applied when the batch is prepared, so a
+ * batch is matched against exactly the queries that were active when its
+ * documents arrived, while later calls queue up for the batches after it.
+ */
+struct Batch
+{
+    vector<pair<QueryID,Query> > queries;   ///< Query changes to apply first. An ended query has no words.
+    DocSlots            docs;               ///< Slot i takes document firstSeq+i once parsed.
+    unsigned long       firstSeq;           ///< Document::seq of the first document.
+    unsigned            numDocs;            ///< The documents submitted.
+    unsigned            parsed;             ///< The documents parsed so far.
+    bool                sealed;             ///< No more documents may join.
+    unsigned            threads;            ///< How many threads match it, 0 until decided.
+
+    Batch (unsigned long first_seq) : firstSeq(first_seq), numDocs(0), parsed(0), sealed(false), threads(0) {}
 
-    QWordE(Word* w, MatchType mt) :
-        length(w->length), letterBits(w->letterBits), common_prefix(0), txt(w->txt), qwindex(w->qwindex[mt])  {}
+    bool runnable () const { return sealed && __atomic_load_n(&parsed, __ATOMIC_ACQUIRE)==numDocs; }
 };
 
-struct QWordH {
-    unsigned letterBits;
-    WordText txt;
-    unsigned qwindex;
+struct EditCol {
+    unsigned VP;
+    unsigned VN;
 
-    QWordH(Word* w, MatchType mt) :
-        letterBits(w->letterBits), txt(w->txt), qwindex(w->qwindex[mt])  {}
+    /** Value of the cell at `row` of the column, given its top cell (= col) */
+    static int cell(const EditCol &c, unsigned col, int row) {
+        unsigned m = (1u << row) - 1;
+        return col + __builtin_popcount(c.VP & m) - __builtin_popcount(c.VN & m);
+    }
+
+    /** The next column, after one more query char whose dword match mask is `Eq` */
+    EditCol advance(unsigned Eq) const {
+        EditCol n;
+        unsigned X  = Eq | VN;
+        unsigned D0 = ((VP + (X & VP)) ^ VP) | X;
+        unsigned HN = VP & D0;
+        unsigned HP = VN | ~(VP | D0);
+        X    = (HP << 1) | 1;
+        n.VN = X & D0;
+        n.VP = (HN << 1) | ~(X | D0);
+        return n;
+    }
+};
+
+/** Moves the entries at positions `order` of column `col` to [lo, lo+order.size()). */
+template <typename T>
+static inline void PermuteColumn (vector<T> &col, unsigned lo, const vector<unsigned> &order)
+{
+    vector<T> moved;
+    moved.reserve(order.size());
+    for (unsigned j : order) moved.push_back(col[j]);
+    copy(moved.begin(), moved.end(), col.begin()+lo);
+}
+
+/**
+ * The edit distance query words, one column per field. The scan of
+ * Intersect reads the letter counts and the common prefixes of every
+ * entry, but the text only of the entries that pass the filter.
+ */
+struct QWEditTable {
+    vector<LetterHist>      hist;           ///< Letter counts.
+    vector<unsigned char>   prefix;         ///< Chars in common with the previous entry.
+    vector<unsigned char>   dead;           ///< Tombstone: no active query has the word any more.
+    vector<unsigned char>   length;
+    vector<unsigned>        letterBits;
+    vector<unsigned>        qwindex;
+    vector<WordText>        txt;
+
+    unsigned size () const { return qwindex.size(); }
+
+    void push_back (const Word *w, unsigned qwi) {
+        hist.emplace_back();
+        MakeLetterHist(w->txt.chars, w->length, hist.back());
+        prefix.push_back(0);
+        dead.push_back(0);
+        length.push_back(w->length);
+        letterBits.push_back(w->letterBits);
+        qwindex.push_back(qwi);
+        txt.push_back(w->txt);
+    }
+
+    void move (unsigned to, unsigned from) {
+        hist[to] = hist[from];
+        prefix[to] = prefix[from];
+        dead[to] = dead[from];
+        length[to] = length[from];
+        letterBits[to] = letterBits[from];
+        qwindex[to] = qwindex[from];
+        txt[to] = txt[from];
+    }
+
+    void truncate (unsigned n) {
+        hist.resize(n);
+        prefix.resize(n);
+        dead.resize(n);
+        length.resize(n);
+        letterBits.resize(n);
+        qwindex.resize(n);
+        txt.resize(n);
+    }
+
+    void permute (unsigned lo, const vector<unsigned> &order) {
+        PermuteColumn(hist, lo, order);
+        PermuteColumn(prefix, lo, order);
+        PermuteColumn(dead, lo, order);
+        PermuteColumn(length, lo, order);
+        PermuteColumn(letterBits, lo, order);
+        PermuteColumn(qwindex, lo, order);
+        PermuteColumn(txt, lo, order);
+    }
+};
+
+/**
+ * The Hamming distance query words of one length and batch, one column
+ * per field, so the kernels stream through the texts alone.
+ */
+struct QWHammBucket {
+    vector<WordText>        txt;
+    vector<unsigned char>   dead;           ///< Tombstone: no active query has the word any more.
+    vector<unsigned>        qwindex;
+
+    unsigned size () const { return qwindex.size(); }
+
+    void push_back (const Word *w, unsigned qwi) {
+        txt.push_back(w->txt);
+        dead.push_back(0);
+        qwindex.push_back(qwi);
+    }
+
+    void permute (const vector<unsigned> &order) {
+        PermuteColumn(txt, 0, order);
+        PermuteColumn(dead, 0, order);
+        PermuteColumn(qwindex, 0, order);
+        truncate(order.size());
+    }
+
+    void truncate (unsigned n) {
+        txt.resize(n);
+        dead.resize(n);
+        qwindex.resize(n);
+    }
+};
+
+/** A word in an index snapshot. */
+struct WordRecord {
+    unsigned        batchFreq;
+    unsigned        lastSeen;
+    unsigned        lastCheck_edit;
+    unsigned        lastCheck_hamm;
+    int             qwindex[3];
+    unsigned        present;        ///< 0 for an unused word id.
+};
+
+/** A query in an index snapshot, its words by id. */
+struct QueryRecord {
+    unsigned        wids[MAX_QUERY_WORDS];
+    int             type;
+    char            numWords;
+    char            dist;
+    char            key;
 };
 
 struct QWMap {
-    vector<QWordH>& operator[] (int length) { return vec[length-MIN_WORD_LENGTH]; }
+    QWHammBucket& operator[] (int length) { return vec[length-MIN_WORD_LENGTH]; }
+    const QWHammBucket& operator[] (int length) const { return vec[length-MIN_WORD_LENGTH]; }
 protected:
-    vector<QWordH> vec[MAX_WORD_LENGTH-MIN_WORD_LENGTH+1];
+    QWHammBucket vec[MAX_WORD_LENGTH-MIN_WORD_LENGTH+1];
 };
 
 #endif
@@ -1,68 +1,134 @@
 #ifndef AUTOMATA_H
 #define AUTOMATA_H
 
-#define NO_TRANS NULL
+#define NO_TRANS 0
 
+/**
+ * A state of the trie, 16 bytes. The transitions are a 26-bit letter
+ * bitmap plus the offset of a packed array of child state ids, one per set
+ * bit in letter order. Both share one 64-bit word, so a new transition is
+ * published with a single store and a reader never sees half of it.
+ * State 0 is the root, so it never appears as a transition target.
+ */
 struct State
 {
+    unsigned long trans;        ///< Bits 0-25: letter bitmap. Bits 32-63: offset of the child ids.
+    Word*         ptr;
 
-    State *trans_letter[26];    /// Suport only letters [a-z]
-    void* ptr;
-
-    State () : ptr(NULL) { for (int l=0; l<26;l++) trans_letter[l]=NO_TRANS;}
-
-    State* setLetterTransition (const char t) { return (trans_letter[t-'a'] = new State());}
-    State* getLetterTransition (const char t) const { return trans_letter[t-'a'];}
-    bool   isFinal () const { return ptr!=NULL; }
+    static unsigned bitmap (unsigned long t) { return (unsigned) t; }
+    static unsigned offset (unsigned long t) { return t >> 32; }
+    static unsigned long pack (unsigned bitmap, unsigned offs) { return ((unsigned long) offs << 32) | bitmap; }
 };
 
 class DFA
 {
 public:
-    DFA (): num_final_states(0) { root = new State();}
+    DFA () { states.alloc(1); }
 
-    unsigned finalStateCount() const { return num_final_states;}
+    unsigned long memory () const { return states.memory() + childIds.memory(); }
 
 protected:
-    State *root;
-    unsigned num_final_states;
+    Arena<State>    states;
+    Arena<unsigned> childIds;
+
+    unsigned getLetterTransition (unsigned s, const char t) const {
+        unsigned long trans = __atomic_load_n(&states[s].trans, __ATOMIC_ACQUIRE);
+        unsigned bit = 1u << (t-'a');
+        if (!(State::bitmap(trans) & bit)) return NO_TRANS;
+        return childIds[State::offset(trans) + __builtin_popcount(State::bitmap(trans) & (bit-1))];
+    }
+
+    /**
+     * Adds the transition, or returns the one another thread added first.
+     * The child ids are copied to a new array with the new state in place,
+     * which is installed along with the new bitmap by a single CAS. Old
+     * arrays (and a state made by a losing thread) stay in the arenas, so
+     * concurrent readers never see freed memory.
+     */
+    unsigned setLetterTransition (unsigned s, const char t) {
+        unsigned bit  = 1u << (t-'a');
+        unsigned next = NO_TRANS;
+        unsigned long trans = __atomic_load_n(&states[s].trans, __ATOMIC_ACQUIRE);
+
+        while (1) {
+            unsigned bmap = State::bitmap(trans), offs = State::offset(trans);
+            unsigned rank = __builtin_popcount(bmap & (bit-1));
+            if (bmap & bit) return childIds[offs+rank];
+
+            unsigned n = __builtin_popcount(bmap);
+            if (next==NO_TRANS) next = states.alloc(1);
+            unsigned noffs = childIds.alloc(n+1);
+            for (unsigned k=0 ; k<rank ; k++) childIds[noffs+k] = childIds[offs+k];
+            childIds[noffs+rank] = next;
+            for (unsigned k=rank ; k<n ; k++) childIds[noffs+k+1] = childIds[offs+k];
+
+            if (__atomic_compare_exchange_n(&states[s].trans, &trans, State::pack(bmap|bit, noffs),
+                                            false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                return next;
+        }
+    }
 };
 
+/** Every method is lock free and may be called concurrently, except clear(). */
 class DFATrie : public DFA
 {
 public:
-    bool insert (WordText &wtxt,  Word** inserted_word) {
-        State *cur=root, *next;
+    /** Returns the state of `wtxt`, adding the missing states on the way. */
+    unsigned insert (WordText &wtxt) {
+        unsigned cur=0, next;
         for (int i=0 ; wtxt.chars[i] ; i++) {
-            if ((next = cur->getLetterTransition(wtxt.chars[i])) == NO_TRANS)
-                cur = cur->setLetterTransition(wtxt.chars[i]);
-            else cur = next;
-        }
-
-        if (cur->ptr==NULL) {
-            *inserted_word = new Word (wtxt, num_final_states);
-            cur->ptr =  (void*) *inserted_word;
-            num_final_states++;
-            return true;
-        }
-        else {
-            *inserted_word = (Word*) cur->ptr;
-            return false;
+            if ((next = getLetterTransition(cur, wtxt.chars[i])) == NO_TRANS)
+                next = setLetterTransition(cur, wtxt.chars[i]);
+            cur = next;
         }
+        return cur;
     }
 
     bool contains (WordText &wtxt,  Word** inserted_word) const {
-        State *cur = root;
+        unsigned cur = 0;
         for (int i=0 ; wtxt.chars[i] ; i++)
-            if ((cur = cur->getLetterTransition(wtxt.chars[i])) == NO_TRANS) return false;
+            if ((cur = getLetterTransition(cur, wtxt.chars[i])) == NO_TRANS) return false;
 
-        if (cur->ptr == NULL) return false;
-        *inserted_word = (Word*) cur->ptr;
+        Word *w = getWord(cur);
+        if (w == NULL) return false;
+        *inserted_word = w;
         return true;
     }
 
-    unsigned size () const {
-        return finalStateCount();
+    Word* getWord (unsigned s) const {
+        return __atomic_load_n(&states[s].ptr, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * Attaches `w` to state `s` if it has no word yet. Either way
+     * `attached` gets the word of the state.
+     */
+    bool setWord (unsigned s, Word *w, Word **attached) {
+        Word *expected = NULL;
+        if (__atomic_compare_exchange_n(&states[s].ptr, &expected, w, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *attached = w;
+            return true;
+        }
+        *attached = expected;
+        return false;
+    }
+
+    /**
+     * Adds `nw` under `wtxt`, unless a word with this text is already
+     * there. Either way `attached` gets the word that the trie keeps.
+     */
+    bool attach (WordText &wtxt, Word *nw, Word **attached) {
+        return setWord(insert(wtxt), nw, attached);
+    }
+
+    /** The trie grows with the words, so there is nothing to size up front. */
+    void reserve (unsigned long) {}
+
+    /** Drops every state. The words themselves belong to the caller. */
+    void clear () {
+        states.clear();
+        childIds.clear();
+        states.alloc(1);
     }
 
 };
@@ -0,0 +1,62 @@
+#ifndef DIST_BITS_H
+#define DIST_BITS_H
+
+/**
+ * The query words a document satisfies, as one bitset per distance level.
+ * Bit q of level d is set when query word q is within distance d of some
+ * document word, so the levels are cumulative and a query of distance D
+ * only tests level D. The four levels of a 64-bit unit sit next to each
+ * other and are updated with four masked ORs, without branches.
+ *
+ * The units in use are listed as they get their first bit, so clear()
+ * and forEach() cost as much as the document, not the query words.
+ */
+class DistBits
+{
+    typedef unsigned long unit;
+
+    vector<unit>        units;          ///< Unit u of level d is units[4*u+d].
+    vector<unsigned>    touched;        ///< Units with a bit set.
+
+public:
+    /** Makes room for query words below `n`. Must not be called between set() and clear(). */
+    void reserve (unsigned n) {
+        unsigned need = 4*((n+63)/64);
+        if (units.size() < need) units.resize(need, 0);
+    }
+
+    void set (unsigned qw, int dist) {
+        unit *L = &units[4*(qw/64)];
+        unit m = 1UL << (qw%64);
+        if (!L[3]) touched.push_back(qw/64);
+        L[0] |= m & -(unit) (dist<=0);
+        L[1] |= m & -(unit) (dist<=1);
+        L[2] |= m & -(unit) (dist<=2);
+        L[3] |= m;
+    }
+
+    /** Whether query word `qw` is satisfied within distance `dist`. */
+    bool test (unsigned qw, int dist) const {
+        return 4*(qw/64) < units.size() && (units[4*(qw/64)+dist] >> (qw%64) & 1);
+    }
+
+    /** Calls `f(qw, dist)` for every satisfied query word, with its smallest distance. */
+    template <typename F>
+    void forEach (F f) const {
+        for (unsigned u : touched) {
+            const unit *L = &units[4*u];
+            for (unit b=L[3] ; b ; b &= b-1) {
+                unit m = b & -b;
+                f(64*u + __builtin_ctzl(b), !(L[0] & m) + !(L[1] & m) + !(L[2] & m));
+            }
+        }
+    }
+
+    void clear () {
+        for (unsigned u : touched) units[4*u] = units[4*u+1] = units[4*u+2] = units[4*u+3] = 0;
+        touched.clear();
+    }
+
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef EDIT_TRIE_H
+#define EDIT_TRIE_H
+
+/**
+ * Trie over the edit distance query words.
+ * A dword is matched against the whole trie by running the bit-parallel
+ * edit distance down every path, one column per level. A subtree is left
+ * as soon as none of its words can be within distance 3 (by the column,
+ * the word lengths or the letters of the subtree), or when it holds
+ * nothing newer than the dword's last check.
+ */
+class EditTrie
+{
+    struct Node {
+        unsigned child;         ///< First child, 0 if none (root is never a child).
+        unsigned sibling;       ///< Next sibling, 0 if none.
+        unsigned stamp;         ///< Newest word stamp in the subtree.
+        unsigned wstamp;        ///< Stamp of the word ending here.
+        unsigned anyBits;       ///< Letters found in any word of the subtree.
+        unsigned allBits;       ///< Letters found in every word of the subtree.
+        int      qwindex;       ///< Query word ending here, -1 if none.
+        char     letter;
+        char     minLength;     ///< Shortest word in the subtree.
+        char     maxLength;     ///< Longest word in the subtree.
+
+        Node (char l) : child(0), sibling(0), stamp(0), wstamp(0), anyBits(0), allBits(~0u),
+            qwindex(-1), letter(l), minLength(MAX_WORD_LENGTH), maxLength(0) {}
+
+        void add (unsigned letterBits, int length, unsigned _stamp) {
+            stamp = _stamp;
+            anyBits |= letterBits;
+            allBits &= letterBits;
+            if (length < minLength) minLength = length;
+            if (length > maxLength) maxLength = length;
+        }
+
+        /**
+         * Each letter present in only one of two words costs at least one
+         * edit, so more than 3 such letters rule the whole subtree out.
+         */
+        bool admits (unsigned dbits, unsigned since) const {
+            return stamp > since &&
+                   __builtin_popcount(dbits & ~anyBits) <= 3 &&
+                   __builtin_popcount(allBits & ~dbits) <= 3;
+        }
+    };
+
+    vector<Node> nodes;
+
+    /**
+     * Whether a word of the subtree of `node` can still end up within
+     * distance 3, given the column `c` at depth `j`. From cell (i,j) at
+     * least |(dn-i)-(L-j)| more edits are needed to reach any (dn,L).
+     */
+    static bool reachable (const EditCol &c, int j, int dn, const Node &node) {
+        int lo = max(0, j-3), hi = min(dn, j+3);
+        if (lo>hi) return false;
+        int v = EditCol::cell(c, j, lo);
+        for (int i=lo ; ; i++) {
+            int L = dn-i+j, gap = 0;
+            if (L < node.minLength) gap = node.minLength-L;
+            else if (L > node.maxLength) gap = L-node.maxLength;
+            if (v+gap<=3) return true;
+            if (i==hi) return false;
+            v += ((c.VP >> i) & 1) - ((c.VN >> i) & 1);
+        }
+    }
+
+    void visit (const Node &node, int j, const unsigned *Peq, int dn, unsigned dbits, unsigned since,
+                EditCol *C, MatchList &matches) const
+    {
+        C[j] = C[j-1].advance(Peq[node.letter-'a']);
+
+        if (node.qwindex>=0 && node.wstamp>since) {
+            int dist = EditCol::cell(C[j], j, dn);
+            if (dist<=3) matches.add(node.qwindex, dist);
+        }
+
+        if (!node.child || !reachable(C[j], j, dn, node)) return;
+
+        for (unsigned c=node.child ; c ; c=nodes[c].sibling)
+            if (nodes[c].admits(dbits, since))
+                visit(nodes[c], j+1, Peq, dn, dbits, since, C, matches);
+    }
+
+public:
+    EditTrie () { nodes.emplace_back(0); }
+
+    /**
+     * Inserts the query word at position `j` of `qw`, stamped with `stamp`.
+     * Stamps must not decrease between calls.
+     */
+    void insert (const QWEditTable &qw, unsigned j, unsigned stamp) {
+        const char *txt = qw.txt[j].chars;
+        unsigned cur=0;
+        nodes[cur].add(qw.letterBits[j], qw.length[j], stamp);
+        for (int i=0 ; txt[i] ; i++) {
+            unsigned c = nodes[cur].child;
+            while (c && nodes[c].letter!=txt[i]) c = nodes[c].sibling;
+            if (!c) {
+                c = nodes.size();
+                nodes.emplace_back(txt[i]);
+                nodes[c].sibling = nodes[cur].child;
+                nodes[cur].child = c;
+            }
+            cur = c;
+            nodes[cur].add(qw.letterBits[j], qw.length[j], stamp);
+        }
+        nodes[cur].qwindex = qw.qwindex[j];
+        nodes[cur].wstamp = stamp;
+    }
+
+    /**
+     * Adds to `matches` every query word with stamp greater than
+     * `since` that is in edit distance d<=3 from the dword described by
+     * `Peq`, `dn` and its letter bits `dbits`.
+     */
+    void search (const unsigned *Peq, int dn, unsigned dbits, unsigned since, MatchList &matches) const {
+        EditCol C[MAX_WORD_LENGTH+1];
+        C[0].VP = (1u << dn) - 1;
+        C[0].VN = 0;
+        if (!nodes[0].admits(dbits, since)) return;
+        for (unsigned c=nodes[0].child ; c ; c=nodes[c].sibling)
+            if (nodes[c].admits(dbits, since))
+                visit(nodes[c], 1, Peq, dn, dbits, since, C, matches);
+    }
+
+    void clear () {
+        nodes.clear();
+        nodes.emplace_back(0);
+    }
+
+    unsigned size () const { return nodes.size(); }
+
+    unsigned long memory () const { return nodes.capacity()*sizeof(Node); }
+
+};
+
+#endif
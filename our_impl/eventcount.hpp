@@ -0,0 +1,48 @@
+#ifndef EVENT_COUNT_H
+#define EVENT_COUNT_H
+
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Lets threads sleep on conditions kept in lock-free structures. A waiter
+ * takes a key with prepareWait(), checks its condition again and then
+ * either cancels or waits on the key; any notify in between makes the
+ * wait return at once, so no wakeup is lost. Notifying costs one load
+ * while nobody waits, and notifyOne() wakes a single sleeper.
+ */
+class EventCount
+{
+    unsigned    epoch;
+    unsigned    waiters;
+
+    void notify (int n) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&waiters, __ATOMIC_RELAXED)) return;
+        __atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+    }
+
+public:
+    EventCount () : epoch(0), waiters(0) {}
+
+    unsigned prepareWait () {
+        __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+        return __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+    }
+
+    void cancelWait () { __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST); }
+
+    void wait (unsigned key) {
+        syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+        __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    void notifyOne () { notify(1); }
+    void notifyAll () { notify(INT_MAX); }
+
+};
+
+#endif
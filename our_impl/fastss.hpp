@@ -0,0 +1,74 @@
+#ifndef FASTSS_H
+#define FASTSS_H
+
+/**
+ * Deletion neighbourhood index (FastSS) over the edit distance query words.
+ * If two words are within edit distance k, deleting at most k chars from
+ * each of them gives a common string. So every variant of a query word
+ * with up to 3 deleted chars is stored here, and a dword only has to be
+ * verified against the query words that share one of its own variants.
+ *
+ * Variants are keyed by a 64-bit fingerprint instead of their text; a
+ * collision only costs one extra EditDist. Each variant points to a list
+ * of mQWEdit positions, newest first, so a search stops at the dword's
+ * last check.
+ */
+class FastSSIndex
+{
+    ListHash<unsigned> variantHash;
+
+    static unsigned long fingerprint (const WordText &v) {
+        unsigned long h = 0;
+        for (unsigned i=0; i<WUNITS_MAX; i++) {
+            h = (h ^ v.ints[i]) * 0x9E3779B97F4A7C15UL;
+            h ^= h >> 29;
+        }
+        return h ? h : 1;
+    }
+
+    /** Calls `f` for `w` and every string made by deleting up to `k` of its chars from `start` on. */
+    template <typename F>
+    static void variants (const WordText &w, int n, int start, int k, F &f) {
+        f(w);
+        if (!k) return;
+        for (int p=start ; p<n ; p++) {
+            WordText v = w;
+            memmove(v.chars+p, v.chars+p+1, n-p);
+            variants(v, n-1, p, k-1, f);
+        }
+    }
+
+public:
+    FastSSIndex () : variantHash(10) {}
+
+    /** Inserts the query word at position `j` of `qw` (mQWEdit). Positions must increase. */
+    void insert (const QWEditTable &qw, unsigned j) {
+        auto f = [&](const WordText &v) { variantHash.add(fingerprint(v), j); };
+        variants(qw.txt[j], qw.length[j], 0, 3, f);
+    }
+
+    /**
+     * Appends to `cand` the mQWEdit positions, not less than `since`, of
+     * the query words that share a variant with the dword. A position may
+     * be appended more than once.
+     */
+    void search (const WordText &dtxt, int dn, unsigned since, vector<unsigned> &cand) const {
+        auto f = [&](const WordText &v) {
+            for (unsigned e=variantHash.head(fingerprint(v)) ; e!=ListHash<unsigned>::NIL ; ) {
+                const ListHash<unsigned>::Entry &en = variantHash.entry(e);
+                if (en.val < since) break;
+                cand.push_back(en.val);
+                e = en.next;
+            }
+        };
+        variants(dtxt, dn, 0, 3, f);
+    }
+
+    /** Drops every entry, before the positions are rebuilt. */
+    void clear () { variantHash.clear(); }
+
+    unsigned long memory () const { return variantHash.memory(); }
+
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef HAMMING_H
+#define HAMMING_H
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/**
+ * Hamming distance kernels over the packed WordText.
+ * Both words have the same length and are zero padded, so the padding
+ * always compares equal and the distance is just the number of differing
+ * bytes among all the WUNITS_MAX units.
+ */
+
+#define HAMM_BATCH 16
+
+typedef void (*HammingBatchFn) (const WordText &dtxt, const WordText *qtxt, unsigned n, int *dist);
+
+static inline int HammingDist_swar (const WordText &dtxt, const WordText &qtxt)
+{
+    int num_mismatches=0;
+    for (unsigned i=0; i<WUNITS_MAX; i++) {
+        wunit x = dtxt.ints[i] ^ qtxt.ints[i];
+        x |= x >> 4; x |= x >> 2; x |= x >> 1;
+        num_mismatches += __builtin_popcountl(x & (~0UL/0xFF));
+    }
+    return num_mismatches;
+}
+
+/** Bit i is set when byte i of the two words is the same. */
+static inline unsigned HammingEqMask (const WordText &dtxt, const WordText &qtxt)
+{
+#ifdef __SSE2__
+    __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) dtxt.chars),
+                                 _mm_loadu_si128((const __m128i*) qtxt.chars));
+    __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (dtxt.chars+16)),
+                                 _mm_loadu_si128((const __m128i*) (qtxt.chars+16)));
+    return _mm_movemask_epi8(eq0) | _mm_movemask_epi8(eq1) << 16;
+#else
+    unsigned eq=0;
+    for (unsigned i=0; i<sizeof(WordText); i++) eq |= (dtxt.chars[i]==qtxt.chars[i]) << i;
+    return eq;
+#endif
+}
+
+#ifdef __SSE2__
+
+static void HammingBatch_sse2 (const WordText &dtxt, const WordText *qtxt, unsigned n, int *dist)
+{
+    __m128i d0 = _mm_loadu_si128((const __m128i*) dtxt.chars);
+    __m128i d1 = _mm_loadu_si128((const __m128i*) (dtxt.chars+16));
+
+    for (unsigned i=0; i<n; i++) {
+        __m128i q0 = _mm_loadu_si128((const __m128i*) qtxt[i].chars);
+        __m128i q1 = _mm_loadu_si128((const __m128i*) (qtxt[i].chars+16));
+        unsigned eq = _mm_movemask_epi8(_mm_cmpeq_epi8(d0, q0)) |
+                      _mm_movemask_epi8(_mm_cmpeq_epi8(d1, q1)) << 16;
+        dist[i] = __builtin_popcount(~eq);
+    }
+}
+
+__attribute__((target("avx2,popcnt")))
+static void HammingBatch_avx2 (const WordText &dtxt, const WordText *qtxt, unsigned n, int *dist)
+{
+    __m256i d = _mm256_loadu_si256((const __m256i*) dtxt.chars);
+
+    for (unsigned i=0; i<n; i++) {
+        __m256i q = _mm256_loadu_si256((const __m256i*) qtxt[i].chars);
+        unsigned eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(d, q));
+        dist[i] = __builtin_popcount(~eq);
+    }
+}
+
+#else
+
+static void HammingBatch_swar (const WordText &dtxt, const WordText *qtxt, unsigned n, int *dist)
+{
+    for (unsigned i=0; i<n; i++) dist[i] = HammingDist_swar(dtxt, qtxt[i]);
+}
+
+#endif
+
+/** Pick the widest kernel the cpu supports. */
+static HammingBatchFn HammingSelect ()
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return HammingBatch_avx2;
+    return HammingBatch_sse2;
+#else
+    return HammingBatch_swar;
+#endif
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef HAMMING_SEG_H
+#define HAMMING_SEG_H
+
+/**
+ * Pigeonhole index over the Hamming distance query words.
+ * A word of length L is split in 4 segments, and two words within Hamming
+ * distance 3 must agree on at least one of them. Every segment (at most 8
+ * chars, so it packs into one 64-bit key) is hashed, per length and per
+ * segment number, to the query words that have it, newest batch first.
+ * Lengths below HAMM_SEG_MIN_LENGTH have 1-char segments, which filter
+ * worse than scanning the whole bucket, so they are left out.
+ */
+
+#define HAMM_SEG_MIN_LENGTH 8
+
+class HammingSegIndex
+{
+    struct Ref {
+        unsigned batch;         ///< Batch of the query word.
+        unsigned pos;           ///< Position in its mQWHamm[batch][length] bucket.
+
+        bool operator== (const Ref &r) const { return batch==r.batch && pos==r.pos; }
+    };
+
+    ListHash<Ref> segHash[MAX_WORD_LENGTH-HAMM_SEG_MIN_LENGTH+1][4];
+
+    static int segBegin (int len, int s) { return s*len/4; }
+
+    static unsigned segMask (int len, int s) {
+        return ((1u << segBegin(len, s+1)) - 1) & ~((1u << segBegin(len, s)) - 1);
+    }
+
+    static unsigned long segKey (const WordText &w, int len, int s) {
+        unsigned long key=0;
+        memcpy(&key, w.chars+segBegin(len, s), segBegin(len, s+1)-segBegin(len, s));
+        return key;
+    }
+
+public:
+    static bool indexed (int len) { return len >= HAMM_SEG_MIN_LENGTH; }
+
+    /** Indexes the bucket of the query words of length `len` that came with batch `batch`. */
+    void insert (const QWHammBucket &bucket, int len, unsigned batch) {
+        if (!indexed(len)) return;
+        for (unsigned pos=0 ; pos<bucket.size() ; pos++)
+            for (int s=0 ; s<4 ; s++)
+                segHash[len-HAMM_SEG_MIN_LENGTH][s].add(segKey(bucket.txt[pos], len, s), Ref{batch, pos});
+    }
+
+    /**
+     * Adds to `matches` every query word of the batches from `since`
+     * on that is in Hamming distance d<=3 from the dword `dtxt`.
+     * A query word is only verified through the first segment it shares.
+     */
+    void search (const WordText &dtxt, int dn, unsigned since, vector<QWMap> &qwhamm, MatchList &matches) const {
+        for (int s=0 ; s<4 ; s++) {
+            const ListHash<Ref> &h = segHash[dn-HAMM_SEG_MIN_LENGTH][s];
+            for (unsigned e=h.head(segKey(dtxt, dn, s)) ; e!=ListHash<Ref>::NIL ; ) {
+                const ListHash<Ref>::Entry &en = h.entry(e);
+                if (en.val.batch < since) break;
+                e = en.next;
+
+                QWHammBucket &bucket = qwhamm[en.val.batch][dn];
+                if (bucket.dead[en.val.pos]) continue;
+                unsigned eq = HammingEqMask(dtxt, bucket.txt[en.val.pos]);
+                bool seen = false;
+                for (int p=0 ; p<s && !seen ; p++) seen = (eq & segMask(dn, p)) == segMask(dn, p);
+                if (seen) continue;
+
+                int dist = __builtin_popcount(~eq);
+                if (dist<=3) matches.add(bucket.qwindex[en.val.pos], dist);
+            }
+        }
+    }
+
+    void clear () {
+        for (auto &len : segHash) for (auto &h : len) h.clear();
+    }
+
+    unsigned long memory () const {
+        unsigned long m=0;
+        for (auto &len : segHash) for (auto &h : len) m += h.memory();
+        return m;
+    }
+
+};
+
+#endif
@@ -65,6 +65,32 @@ public:
 
     }
 
+    /** Makes room for the indexes below `n`, so that testAndSet() never has to grow. */
+    void reserve (unsigned n) {
+        if (n <= capacity) return;
+        unsigned numUnits_old=numUnits;
+        numUnits = (n + BITS_PER_UNIT-1) / BITS_PER_UNIT;
+        capacity = numUnits*BITS_PER_UNIT;
+        units = (unit*) realloc (units, numUnits*sizeof(unit));
+        for (unsigned i=numUnits_old ; i<numUnits ; i++) units[i]=0;
+    }
+
+    /**
+     * Thread safe insertion of an index below the reserved capacity. Only
+     * the bit is set: the caller that gets true owns the index and passes
+     * it to append() later.
+     */
+    bool testAndSet (unsigned index) {
+        unit mask = 1L << (index % BITS_PER_UNIT);
+        return !(__atomic_fetch_or(&units[index / BITS_PER_UNIT], mask, __ATOMIC_RELAXED) & mask);
+    }
+
+    /** Counts the indexes won by testAndSet(). Not thread safe. */
+    void append (const vector<unsigned> &indexes) {
+        mSize += indexes.size();
+        if (keepIndexVec) indexVec.insert(indexVec.end(), indexes.begin(), indexes.end());
+    }
+
     bool exists (unsigned index) {
         if (index>=capacity) return false;
         unsigned unit_offs = index / BITS_PER_UNIT;
@@ -0,0 +1,78 @@
+#ifndef LIST_HASH_H
+#define LIST_HASH_H
+
+/**
+ * Open addressing hash table from a non-zero 64-bit key to a list of
+ * values. Lists live in one shared pool and are kept newest first, so a
+ * reader can stop walking as soon as it reaches values it has seen before.
+ * Inserting is not thread safe; concurrent lookups are.
+ */
+template <typename V>
+class ListHash
+{
+public:
+    static const unsigned NIL = ~0u;
+
+    struct Entry {
+        V        val;
+        unsigned next;
+    };
+
+private:
+    struct Slot {
+        unsigned long key;      ///< 0 if the slot is empty.
+        unsigned head;          ///< Newest entry of the key.
+    };
+
+    vector<Slot>    slots;
+    vector<Entry>   pool;
+    unsigned        used;
+    unsigned        bits;
+
+    unsigned find (unsigned long key) const {
+        unsigned mask = slots.size()-1;
+        unsigned i = (key * 0x9E3779B97F4A7C15UL) >> (64-bits);
+        while (slots[i].key && slots[i].key!=key) i = (i+1) & mask;
+        return i;
+    }
+
+    void grow () {
+        vector<Slot> old;
+        old.swap(slots);
+        bits++;
+        slots.assign(1u << bits, Slot{0, NIL});
+        for (Slot &s : old) if (s.key) slots[find(s.key)] = s;
+    }
+
+public:
+    ListHash (unsigned _bits=4) : slots(1u << _bits, Slot{0, NIL}), used(0), bits(_bits) {}
+
+    /** Prepends `val` to the list of `key`, unless it is already the newest value there. */
+    void add (unsigned long key, const V &val) {
+        if (2*(used+1) > slots.size()) grow();
+        unsigned i = find(key);
+        if (!slots[i].key) { slots[i].key = key; used++; }
+        else if (pool[slots[i].head].val == val) return;
+        pool.push_back(Entry{val, slots[i].head});
+        slots[i].head = pool.size()-1;
+    }
+
+    /** The newest entry of `key`, NIL if none. */
+    unsigned head (unsigned long key) const { return slots[find(key)].head; }
+
+    const Entry &entry (unsigned e) const { return pool[e]; }
+
+    unsigned long memory () const {
+        return slots.capacity()*sizeof(Slot) + pool.capacity()*sizeof(Entry);
+    }
+
+    /** Drops every key and value, keeping the table size. */
+    void clear () {
+        slots.assign(slots.size(), Slot{0, NIL});
+        pool.clear();
+        used = 0;
+    }
+
+};
+
+#endif
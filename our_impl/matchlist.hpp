@@ -0,0 +1,72 @@
+#ifndef MATCH_LIST_H
+#define MATCH_LIST_H
+
+/**
+ * The query words a document word matches, with their distances. Every
+ * match is one 32-bit entry, qwindex<<2 | distance, in a single array
+ * that grows by doubling: 16 bytes per word instead of four vectors.
+ * Not thread safe; a word is only ever updated by one thread at a time.
+ */
+class MatchList
+{
+    unsigned*   data;
+    unsigned    mSize;
+    unsigned    capacity;
+
+public:
+    MatchList () : data(NULL), mSize(0), capacity(0) {}
+
+    ~MatchList () { free(data); }
+
+    MatchList (const MatchList&) = delete;
+    MatchList& operator= (const MatchList&) = delete;
+
+    void add (unsigned qwindex, int dist) {
+        if (mSize == capacity) {
+            capacity = capacity ? 2*capacity : 4;
+            data = (unsigned*) realloc(data, capacity*sizeof(unsigned));
+        }
+        data[mSize++] = qwindex << 2 | dist;
+    }
+
+    /** Replaces the entries with the `n` packed entries at `entries`. */
+    void assign (const unsigned *entries, unsigned n) {
+        clear();
+        if (!n) return;
+        capacity = mSize = n;
+        data = (unsigned*) malloc(capacity*sizeof(unsigned));
+        memcpy(data, entries, n*sizeof(unsigned));
+    }
+
+    static unsigned qwindex (unsigned entry) { return entry >> 2; }
+    static int dist (unsigned entry) { return entry & 3; }
+
+    const unsigned* begin () const { return data; }
+    const unsigned* end () const { return data+mSize; }
+    unsigned size () const { return mSize; }
+
+    /** Drops the entries whose query word `dead(qwindex)` says is gone, shrinking the array when mostly empty. */
+    template <typename F>
+    void removeIf (F dead) {
+        unsigned out=0;
+        for (unsigned i=0 ; i<mSize ; i++)
+            if (!dead(qwindex(data[i]))) data[out++] = data[i];
+        mSize = out;
+        if (!mSize) clear();
+        else if (4*mSize <= capacity) {
+            capacity = mSize;
+            data = (unsigned*) realloc(data, capacity*sizeof(unsigned));
+        }
+    }
+
+    void clear () {
+        free(data);
+        data = NULL;
+        mSize = capacity = 0;
+    }
+
+    unsigned long memory () const { return capacity*sizeof(unsigned); }
+
+};
+
+#endif
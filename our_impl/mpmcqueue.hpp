@@ -0,0 +1,73 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+/**
+ * Bounded lock-free queue for any number of producers and consumers. Every
+ * cell carries a sequence number telling whether it is free for the push
+ * of its lap or holds the value for the pop of its lap, so push and pop are
+ * one CAS on their own counter plus a release store on the cell. `T` must
+ * be trivially copyable.
+ */
+template <typename T>
+class MPMCQueue
+{
+    struct Cell {
+        unsigned long   seq;
+        T               data;
+    };
+
+    Cell*               cells;
+    unsigned long       mask;
+    alignas(64) unsigned long head;     ///< Next push.
+    alignas(64) unsigned long tail;     ///< Next pop.
+
+public:
+    /** `capacity` must be a power of two. */
+    MPMCQueue (unsigned long capacity) : cells(new Cell[capacity]), mask(capacity-1), head(0), tail(0) {
+        for (unsigned long i=0 ; i<capacity ; i++) cells[i].seq = i;
+    }
+
+    ~MPMCQueue () { delete[] cells; }
+
+    MPMCQueue (const MPMCQueue&) = delete;
+    MPMCQueue& operator= (const MPMCQueue&) = delete;
+
+    /** Returns false when the queue is full. */
+    bool push (const T &val) {
+        unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        while (1) {
+            Cell &c = cells[pos & mask];
+            long diff = (long) __atomic_load_n(&c.seq, __ATOMIC_ACQUIRE) - (long) pos;
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&head, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    c.data = val;
+                    __atomic_store_n(&c.seq, pos+1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;
+            else pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+
+    /** Returns false when the queue is empty. */
+    bool pop (T &val) {
+        unsigned long pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        while (1) {
+            Cell &c = cells[pos & mask];
+            long diff = (long) __atomic_load_n(&c.seq, __ATOMIC_ACQUIRE) - (long) (pos+1);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&tail, &pos, pos+1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    val = c.data;
+                    __atomic_store_n(&c.seq, pos+mask+1, __ATOMIC_RELEASE);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;
+            else pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+
+};
+
+#endif
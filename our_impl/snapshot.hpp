@@ -0,0 +1,114 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * The index snapshot file: a sequence of values and arrays, each array an
+ * 8-byte element count followed by the elements, everything aligned to 16
+ * bytes. Words, query words and queries are referred to by id, never by
+ * address, so the file can be mapped anywhere and read in place.
+ */
+
+#define SNAPSHOT_MAGIC   0x3230584449474953UL     ///< "SIGIDX02"
+#define SNAPSHOT_ALIGN   16
+
+class SnapshotWriter
+{
+    FILE*   f;
+    bool    ok;
+
+    void raw (const void *p, unsigned long n) {
+        static const char zeros[SNAPSHOT_ALIGN] = {0};
+        if (!ok) return;
+        if (n && fwrite(p, 1, n, f) != n) ok = false;
+        if (n % SNAPSHOT_ALIGN && fwrite(zeros, 1, SNAPSHOT_ALIGN - n % SNAPSHOT_ALIGN, f) != SNAPSHOT_ALIGN - n % SNAPSHOT_ALIGN) ok = false;
+    }
+
+public:
+    SnapshotWriter (const char *path) : f(fopen(path, "wb")), ok(f != NULL) {}
+
+    ~SnapshotWriter () { if (f) fclose(f); }
+
+    template <typename T>
+    void put (const T &val) { raw(&val, sizeof(T)); }
+
+    template <typename T>
+    void array (const T *p, unsigned long n) {
+        put(n);
+        raw(p, n*sizeof(T));
+    }
+
+    template <typename T>
+    void array (const vector<T> &v) { array(v.data(), v.size()); }
+
+    /** Returns false if anything failed to be written. */
+    bool close () {
+        if (f && fclose(f)) ok = false;
+        f = NULL;
+        return ok;
+    }
+
+};
+
+class SnapshotReader
+{
+    const char*     base;
+    unsigned long   size;
+    unsigned long   pos;
+    bool            ok;
+
+    const void* raw (unsigned long n) {
+        unsigned long padded = (n + SNAPSHOT_ALIGN-1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+        if (!ok || size - pos < padded) { ok = false; return NULL; }
+        const void *p = base + pos;
+        pos += padded;
+        return p;
+    }
+
+public:
+    SnapshotReader (const char *path) : base(NULL), size(0), pos(0), ok(false) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED) { base = (const char*) m; size = st.st_size; ok = true; }
+        }
+        close(fd);
+    }
+
+    ~SnapshotReader () { if (base) munmap((void*) base, size); }
+
+    /** False once the file could not be mapped or a read ran past its end. */
+    bool good () const { return ok; }
+
+    template <typename T>
+    void get (T &val) {
+        const void *p = raw(sizeof(T));
+        if (p) memcpy(&val, p, sizeof(T));
+    }
+
+    /** The `n` elements of the next array, in place in the mapping. */
+    template <typename T>
+    const T* array (unsigned long &n) {
+        n = 0;
+        get(n);
+        if (ok && n > (size - pos) / sizeof(T)) ok = false;
+        return (const T*) raw(n*sizeof(T));
+    }
+
+    template <typename T>
+    void array (vector<T> &v) {
+        unsigned long n;
+        const T *p = array<T>(n);
+        if (p) v.assign(p, p+n);
+        else v.clear();
+    }
+
+};
+
+#endif
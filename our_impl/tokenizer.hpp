@@ -0,0 +1,68 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+/**
+ * The tokenizer reads whole 16-byte blocks, so every string it is given
+ * must have TOKEN_PAD readable bytes after its terminating NUL.
+ */
+#define TOKEN_PAD 32
+
+/**
+ * Calls `f(word, length)` for every space separated word of the NUL
+ * terminated `str`. The delimiters of 16 bytes at a time are found with
+ * one compare and a movemask. Empty words are skipped.
+ */
+template <typename F>
+static inline void Tokenize (const char *str, F f)
+{
+    const char *start = str;
+#ifdef __SSE2__
+    const __m128i spaces = _mm_set1_epi8(' ');
+    const __m128i zeros  = _mm_setzero_si128();
+
+    for (const char *p = str ; ; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) p);
+        unsigned nul  = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zeros));
+        unsigned dels = _mm_movemask_epi8(_mm_cmpeq_epi8(block, spaces));
+        if (nul) dels = (dels & ((nul & -nul) - 1)) | (nul & -nul);
+
+        for ( ; dels ; dels &= dels-1) {
+            const char *end = p + __builtin_ctz(dels);
+            if (end > start) f(start, end-start);
+            start = end+1;
+        }
+        if (nul) return;
+    }
+#else
+    for (const char *p = str ; ; p++) {
+        if (*p==' ' || !*p) {
+            if (p > start) f(start, p-start);
+            start = p+1;
+        }
+        if (!*p) return;
+    }
+#endif
+}
+
+/** Fills `wtxt` with the `len` chars of `w`, zero padded, in two 16-byte stores. */
+static inline void MakeWordText (const char *w, int len, WordText &wtxt)
+{
+#ifdef __SSE2__
+    const __m128i idx0 = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i idx1 = _mm_setr_epi8(16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    __m128i l = _mm_set1_epi8(len);
+    __m128i lo = _mm_and_si128(_mm_loadu_si128((const __m128i*) w), _mm_cmpgt_epi8(l, idx0));
+    __m128i hi = _mm_and_si128(_mm_loadu_si128((const __m128i*) (w+16)), _mm_cmpgt_epi8(l, idx1));
+    _mm_storeu_si128((__m128i*) wtxt.chars, lo);
+    _mm_storeu_si128((__m128i*) (wtxt.chars+16), hi);
+#else
+    for (unsigned wi=0; wi<WUNITS_MAX; wi++) wtxt.ints[wi]=0;
+    memcpy(wtxt.chars, w, len);
+#endif
+}
+
+#endif
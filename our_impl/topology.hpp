@@ -0,0 +1,81 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <sched.h>
+
+/** The CPUs this process may run on. */
+static inline vector<int> AllowedCpus ()
+{
+    vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c=0 ; c<CPU_SETSIZE ; c++)
+            if (CPU_ISSET(c, &set)) cpus.push_back(c);
+    }
+    if (cpus.empty()) cpus.push_back(0);
+    return cpus;
+}
+
+/** Parses a sysfs cpulist such as "0-3,8-11". */
+static inline vector<int> ParseCpuList (const char *s)
+{
+    vector<int> cpus;
+    while (*s >= '0' && *s <= '9') {
+        char *e;
+        int lo = strtol(s, &e, 10), hi = lo;
+        if (*e == '-') hi = strtol(e+1, &e, 10);
+        for (int c=lo ; c<=hi ; c++) cpus.push_back(c);
+        s = *e == ',' ? e+1 : e;
+    }
+    return cpus;
+}
+
+/**
+ * The allowed CPUs grouped by NUMA node, as listed in sysfs. Without
+ * sysfs everything is one node.
+ */
+static inline vector<vector<int> > NumaNodes ()
+{
+    vector<int> allowed = AllowedCpus();
+    vector<vector<int> > nodes;
+    char path[64], list[4096];
+
+    for (int n=0 ; ; n++) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *f = fopen(path, "r");
+        if (!f) break;
+        vector<int> cpus;
+        if (fgets(list, sizeof(list), f))
+            for (int c : ParseCpuList(list))
+                if (binary_search(allowed.begin(), allowed.end(), c)) cpus.push_back(c);
+        fclose(f);
+        if (!cpus.empty()) nodes.push_back(cpus);
+    }
+
+    if (nodes.empty()) nodes.push_back(allowed);
+    return nodes;
+}
+
+/**
+ * The CPU for each of `n` threads. "compact" fills one NUMA node before
+ * moving to the next, so neighbouring threads share caches and memory.
+ * "spread" deals the threads round robin over the nodes, to use the
+ * memory bandwidth of all of them.
+ */
+static inline vector<int> PlaceThreads (unsigned n, bool spread)
+{
+    vector<vector<int> > nodes = NumaNodes();
+    vector<int> order, place;
+
+    if (spread) {
+        for (unsigned i=0 ; order.size()<n && i<CPU_SETSIZE ; i++)
+            for (auto &node : nodes)
+                if (i < node.size()) order.push_back(node[i]);
+    }
+    else for (auto &node : nodes) order.insert(order.end(), node.begin(), node.end());
+
+    for (unsigned t=0 ; t<n ; t++) place.push_back(order[t % order.size()]);
+    return place;
+}
+
+#endif
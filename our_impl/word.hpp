@@ -17,23 +17,28 @@ struct Word
 
     unsigned            lastCheck_edit;
     unsigned            lastCheck_hamm;
+    unsigned            batchFreq;          ///< In how many batches the word has been seen.
+    unsigned            lastSeen;           ///< mBatchId after the last batch the word was seen in.
 
     int                 qwindex[3];
     unsigned            wid;
 
     WordText            txt;
 
-    vector<unsigned>    editMatches[4];
-    vector<unsigned>    hammMatches[4];
+    MatchList           editMatches;
+    MatchList           hammMatches;
 
     Word (WordText &wtxt, unsigned globindex) :
         letterBits(0),
         lastCheck_edit(0),
         lastCheck_hamm(0),
+        batchFreq(0),
+        lastSeen(0),
         wid(globindex),
         txt(wtxt)
     {
         unsigned wi;
+        qwindex[MT_EXACT_MATCH] = qwindex[MT_HAMMING_DIST] = qwindex[MT_EDIT_DIST] = -1;
         for (wi=0; txt.chars[wi]; wi++) letterBits |= 1 << (txt.chars[wi]-'a');
         length = wi;
     }
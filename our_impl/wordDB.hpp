@@ -1,43 +1,93 @@
 #ifndef WORD_HASH_TABLE_H
 #define WORD_HASH_TABLE_H
 
-class WordDB
+/**
+ * Lock free word storage. Word ids index `wvec`, whose chunks never move,
+ * so getWord() is safe while other threads insert.
+ *
+ * `Index` maps the text to the word: DFATrie, or WordHash when built with
+ * -DWORDDB_HASH. It needs a lock free contains(), and attach(), which adds
+ * a word unless one with the same text got there first.
+ */
+template <class Index>
+class BasicWordDB
 {
-    DFATrie             trie;
-    vector<Word*>       wvec;
-    unsigned            capacity;
-    pthread_mutex_t     mutex;
+    Index               index;
+    Arena<Word*>        wvec;
 
-    void lock()   { pthread_mutex_lock(&mutex); }
-
-    void unlock() { pthread_mutex_unlock(&mutex); }
+    /** Makes `w` reachable by its id, if it is not yet. */
+    void publish (Word *w) {
+        if (!__atomic_load_n(&wvec[w->wid], __ATOMIC_ACQUIRE))
+            __atomic_store_n(&wvec[w->wid], w, __ATOMIC_RELEASE);
+    }
 
 public:
-    WordDB () { pthread_mutex_init(&mutex,   NULL);}
+    ~BasicWordDB () { clear(); }
 
-    Word *getWord (unsigned wid) const { return wvec[wid]; }
+    /** The word with id `wid`, or NULL if the id is unused or its word not attached yet. */
+    Word *getWord (unsigned wid) const { return __atomic_load_n(&wvec[wid], __ATOMIC_ACQUIRE); }
 
+    /** Upper bound of the word ids handed out so far. */
     unsigned size() const { return wvec.size(); }
 
     /**
      * Inserts the word with text: `wtxt`.
      * Actually a new word is inserted and space is allocated, ONLY
      * when the word does not already exist in our storage.
+     * When two threads race on the same new word, the id taken by
+     * the loser is left unused. A word is published under its id only
+     * once the index holds it, so the loser's word is never seen by
+     * anyone and can be freed; whoever returns a word publishes it, so
+     * its id is valid as soon as any thread has it.
      */
     bool insert (WordText &wtxt, Word** inserted_word) {
-        if (trie.contains(wtxt, inserted_word)) return false;
-
-        lock();
-        if (trie.insert(wtxt, inserted_word)) {
-            wvec.push_back(*inserted_word);
-            unlock();
-            return true;
+        if (index.contains(wtxt, inserted_word)) {
+            publish(*inserted_word);
+            return false;
         }
 
-        unlock();
-        return false;
+        unsigned wid = wvec.alloc(1);
+        Word *nw = new Word (wtxt, wid);
+        bool added = index.attach(wtxt, nw, inserted_word);
+        if (!added) delete nw;
+        publish(*inserted_word);
+        return added;
+    }
+
+    /**
+     * Appends the next word id, holding a new word with text `wtxt`, or
+     * left unused if `wtxt` is NULL. For LoadIndex, which recreates the
+     * ids in order on an empty db, so it is not thread safe.
+     */
+    Word *restore (WordText *wtxt) {
+        unsigned wid = wvec.alloc(1);
+        if (!wtxt) return wvec[wid] = NULL;
+        Word *nw = new Word (*wtxt, wid), *attached;
+        wvec[wid] = nw;
+        index.attach(*wtxt, nw, &attached);
+        return nw;
+    }
+
+    /** Sizes the index for about `words` words. Only on an empty db. */
+    void reserve (unsigned long words) { index.reserve(words); }
+
+    /** Frees every word and the index. Not to be called while anyone else uses the db. */
+    void clear () {
+        for (unsigned wid=0 ; wid<wvec.size() ; wid++) delete wvec[wid];
+        wvec.clear();
+        index.clear();
+    }
+
+    unsigned long memory () const {
+        return index.memory() + wvec.memory() + wvec.size()*sizeof(Word);
     }
 
 };
 
+#ifdef WORDDB_HASH
+typedef BasicWordDB<WordHash> WordDB;
+#else
+typedef BasicWordDB<DFATrie> WordDB;
+#endif
+
 #endif
@@ -0,0 +1,146 @@
+#ifndef WORD_HASH_H
+#define WORD_HASH_H
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define WORD_HASH_BITS 15      ///< Default log2 of the head groups: 512K slots.
+
+/**
+ * Lock free hash index of words, an alternative to DFATrie for WordDB.
+ * The key is the packed WordText, hashed with one multiply per unit. The
+ * table is made of groups of 16 slots, each with a 1-byte tag (7 bits of
+ * the hash, so never 0) that is probed with a single SIMD compare. A full
+ * group is chained to an overflow group taken from an arena.
+ *
+ * The head groups never grow once words are in: reserve() sizes them up
+ * front, for about 8 words per group. Past that the table still works but
+ * degrades to chaining, every group adding one more overflow group to the
+ * walk for each 16 further words that hash to it.
+ *
+ * A slot is claimed by a CAS on its word pointer, and only then gets its
+ * tag, so a zero tag means "empty or being filled". Slots of a group are
+ * claimed strictly in order, so two threads adding the same word meet on
+ * the same slot and the loser finds the winner's word there.
+ */
+class WordHash
+{
+    static const unsigned GROUP = 16;
+
+    struct Group {
+        unsigned char   tags[GROUP];
+        Word*           words[GROUP];
+        unsigned        next;           ///< Overflow group, 0 if none.
+    };
+
+    Group*              heads;
+    unsigned            bits;           ///< log2 of the number of head groups.
+    Arena<Group, 10>    overflow;
+
+    static unsigned long hash (const WordText &wtxt) {
+        unsigned long h = 0;
+        for (unsigned i=0; i<WUNITS_MAX; i++) {
+            h = (h ^ wtxt.ints[i]) * 0x9E3779B97F4A7C15UL;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+
+    static unsigned char tagOf (unsigned long h) { return (h >> 56) | 1; }
+
+    /** Bit i is set if slot i has tag `tag`. */
+    static unsigned matchTags (const Group &g, unsigned char tag) {
+#ifdef __SSE2__
+        __m128i tags = _mm_loadu_si128((const __m128i*) g.tags);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag)));
+#else
+        unsigned m=0;
+        for (unsigned i=0; i<GROUP; i++) m |= (__atomic_load_n(&g.tags[i], __ATOMIC_RELAXED)==tag) << i;
+        return m;
+#endif
+    }
+
+    Group &group (unsigned long h, unsigned next) const {
+        return next ? overflow[next] : heads[h & ((1u << bits)-1)];
+    }
+
+public:
+    WordHash () : bits(WORD_HASH_BITS) {
+        heads = new Group[1u << bits]();
+        overflow.alloc(1);
+    }
+
+    ~WordHash () { delete[] heads; }
+
+    bool contains (WordText &wtxt, Word** inserted_word) const {
+        unsigned long h = hash(wtxt);
+        unsigned char tag = tagOf(h);
+
+        for (const Group *g = &group(h, 0) ; ; g = &group(h, __atomic_load_n(&g->next, __ATOMIC_ACQUIRE))) {
+            for (unsigned m = matchTags(*g, tag) ; m ; m &= m-1) {
+                Word *w = __atomic_load_n(&g->words[__builtin_ctz(m)], __ATOMIC_ACQUIRE);
+                if (w->equals(wtxt)) { *inserted_word = w; return true; }
+            }
+            if (matchTags(*g, 0) || !__atomic_load_n(&g->next, __ATOMIC_ACQUIRE)) return false;
+        }
+    }
+
+    /**
+     * Adds `nw` under `wtxt`, unless a word with this text is already
+     * there. Either way `attached` gets the word that the index keeps.
+     */
+    bool attach (WordText &wtxt, Word *nw, Word **attached) {
+        unsigned long h = hash(wtxt);
+        Group *g = &group(h, 0);
+
+        while (1) {
+            for (unsigned i=0 ; i<GROUP ; i++) {
+                Word *w = __atomic_load_n(&g->words[i], __ATOMIC_ACQUIRE);
+                if (!w) {
+                    if (__atomic_compare_exchange_n(&g->words[i], &w, nw, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                        __atomic_store_n(&g->tags[i], tagOf(h), __ATOMIC_RELEASE);
+                        *attached = nw;
+                        return true;
+                    }
+                }
+                if (w->equals(wtxt)) { *attached = w; return false; }
+            }
+
+            unsigned next = __atomic_load_n(&g->next, __ATOMIC_ACQUIRE);
+            if (!next) {
+                unsigned ng = overflow.alloc(1);
+                if (__atomic_compare_exchange_n(&g->next, &next, ng, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    next = ng;
+            }
+            g = &group(h, next);
+        }
+    }
+
+    /**
+     * Sizes the head groups for about `words` words, never below the
+     * default. Only while the table is empty and nobody else uses it.
+     */
+    void reserve (unsigned long words) {
+        unsigned b = WORD_HASH_BITS;
+        while (b < 28 && (8UL << b) < words) b++;
+        if (b == bits) return;
+        delete[] heads;
+        bits = b;
+        heads = new Group[1u << bits]();
+    }
+
+    /** Drops every entry. The words themselves belong to the caller. */
+    void clear () {
+        memset(heads, 0, (1u << bits)*sizeof(Group));
+        overflow.clear();
+        overflow.alloc(1);
+    }
+
+    unsigned long memory () const {
+        return (1u << bits)*sizeof(Group) + overflow.memory();
+    }
+
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef WORD_SET_H
+#define WORD_SET_H
+
+/**
+ * The distinct word ids of a document: an open addressing table with
+ * linear probing, kept at most half full, next to the ids in order of
+ * first appearance. Its size follows the document, not the dictionary,
+ * and clear() only empties the slots in use.
+ */
+class WordSet
+{
+public:
+    vector<unsigned> indexVec;
+
+private:
+    enum : unsigned { EMPTY = ~0u };
+
+    unsigned*   slots;
+    unsigned    bits;
+
+    unsigned slot (unsigned wid) const { return (wid * 2654435761u) >> (32-bits); }
+
+    void grow () {
+        free(slots);
+        bits++;
+        slots = (unsigned*) malloc((1u << bits) * sizeof(unsigned));
+        memset(slots, 0xff, (1u << bits) * sizeof(unsigned));
+        for (unsigned wid : indexVec) place(wid);
+    }
+
+    void place (unsigned wid) {
+        unsigned mask = (1u << bits) - 1, s = slot(wid);
+        while (slots[s] != EMPTY) s = (s+1) & mask;
+        slots[s] = wid;
+    }
+
+public:
+    WordSet () : slots(NULL), bits(4) {
+        slots = (unsigned*) malloc((1u << bits) * sizeof(unsigned));
+        memset(slots, 0xff, (1u << bits) * sizeof(unsigned));
+    }
+
+    ~WordSet () { free(slots); }
+
+    WordSet (const WordSet&) = delete;
+    WordSet& operator= (const WordSet&) = delete;
+
+    bool insert (unsigned wid) {
+        unsigned mask = (1u << bits) - 1, s = slot(wid);
+        for ( ; slots[s] != EMPTY ; s = (s+1) & mask)
+            if (slots[s] == wid) return false;
+        slots[s] = wid;
+        indexVec.push_back(wid);
+        if (2*indexVec.size() > mask) grow();
+        return true;
+    }
+
+    bool exists (unsigned wid) const {
+        unsigned mask = (1u << bits) - 1, s = slot(wid);
+        for ( ; slots[s] != EMPTY ; s = (s+1) & mask)
+            if (slots[s] == wid) return true;
+        return false;
+    }
+
+    unsigned size () const { return indexVec.size(); }
+
+    void clear () {
+        unsigned mask = (1u << bits) - 1;
+        for (unsigned wid : indexVec)
+            for (unsigned s = slot(wid) ; slots[s] != EMPTY ; s = (s+1) & mask) slots[s] = EMPTY;
+        indexVec.clear();
+    }
+
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+/**
+ * Work stealing split of the index range [0,n) of a phase. Every thread
+ * starts with an equal slice, takes chunks from its front and, when it
+ * runs dry, steals the back half of the largest slice left. Both ends of a
+ * slice share one 64-bit word, so taking and stealing are single CAS
+ * operations, and slices sit on their own cache lines.
+ */
+class WorkPool
+{
+    struct alignas(64) Slice {
+        unsigned long range;                ///< Low 32 bits: first index. High 32 bits: end.
+    };
+
+    Slice*      slices;
+    unsigned    numThreads;
+    unsigned    chunk;
+
+    static unsigned first (unsigned long r) { return (unsigned) r; }
+    static unsigned end (unsigned long r) { return r >> 32; }
+    static unsigned long pack (unsigned first, unsigned end) { return ((unsigned long) end << 32) | first; }
+
+    /** Moves half of the largest other slice to the (empty) slice of `tid`. */
+    bool steal (unsigned tid) {
+        while (1) {
+            unsigned victim = tid, most = 0;
+            for (unsigned t=0 ; t<numThreads ; t++) {
+                unsigned long r = __atomic_load_n(&slices[t].range, __ATOMIC_RELAXED);
+                if (end(r) > first(r) && end(r)-first(r) > most) { most = end(r)-first(r); victim = t; }
+            }
+            if (victim == tid) return false;
+
+            unsigned long r = __atomic_load_n(&slices[victim].range, __ATOMIC_RELAXED);
+            if (end(r) <= first(r)) continue;
+            unsigned mid = end(r) - (end(r)-first(r)+1)/2;
+            if (__atomic_compare_exchange_n(&slices[victim].range, &r, pack(first(r), mid),
+                                            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&slices[tid].range, pack(mid, end(r)), __ATOMIC_RELAXED);
+                return true;
+            }
+        }
+    }
+
+public:
+    WorkPool () : slices(NULL), numThreads(0), chunk(1) {}
+
+    ~WorkPool () { free(slices); }
+
+    /** Makes room for up to `max_threads` threads. */
+    void init (unsigned max_threads) {
+        free(slices);
+        if (posix_memalign((void**) &slices, 64, max_threads*sizeof(Slice))) exit(-1);
+        memset(slices, 0, max_threads*sizeof(Slice));
+    }
+
+    /**
+     * Splits [0,n) among threads 0..`threads`-1 for the next phase.
+     * Not to be called while the pool is in use.
+     */
+    void reset (unsigned n, unsigned chunk_size, unsigned threads) {
+        chunk = chunk_size;
+        numThreads = threads;
+        for (unsigned t=0 ; t<numThreads ; t++)
+            slices[t].range = pack((unsigned long) n*t/numThreads, (unsigned long) n*(t+1)/numThreads);
+    }
+
+    /** Gives thread `tid` its next chunk [lo,hi). Returns false when the whole range is done. */
+    bool next (unsigned tid, unsigned &lo, unsigned &hi) {
+        while (1) {
+            unsigned long r = __atomic_load_n(&slices[tid].range, __ATOMIC_RELAXED);
+            if (end(r) > first(r)) {
+                lo = first(r);
+                hi = min(end(r), lo+chunk);
+                if (__atomic_compare_exchange_n(&slices[tid].range, &r, pack(hi, end(r)),
+                                                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    return true;
+            }
+            else if (!steal(tid)) return false;
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <core.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "testfile.hpp"
+
+/**
+ * Checks the result delivery extensions against a test file of test_driver:
+ *  - order:    SetResultOrder(1), documents must come in MatchDocument order
+ *  - callback: SetResultCallback, every document exactly once
+ *  - batch:    GetAvailResults with a tiny id buffer, grown on EC_FAIL from
+ *              the size left in p_docs[0]
+ * Every mode runs in its own process, on a fresh index.
+ *
+ * Build with "make tests", then: tests/test_results <test file> [order|callback|batch]
+ */
+
+static TestFile test;
+static unsigned errors;
+
+static void Check (DocID doc_id, const QueryID *ids, unsigned n)
+{
+    if (!test.check(doc_id, ids, n)) {
+        if (errors++ < 10) printf("  document %u: wrong results\n", doc_id);
+    }
+}
+
+static unsigned TestOrder ()
+{
+    std::deque<DocID> submitted;
+    SetResultOrder(1);
+    InitializeIndex();
+
+    auto collect = [&] () {
+        DocID doc_id; unsigned n; QueryID *ids;
+        if (GetNextAvailRes(&doc_id, &n, &ids) != EC_SUCCESS) { errors++; return; }
+        if (doc_id != submitted.front()) {
+            if (errors++ < 10) printf("  document %u delivered before %u\n", doc_id, submitted.front());
+        }
+        submitted.pop_front();
+        Check(doc_id, ids, n);
+        free(ids);
+    };
+
+    for (const TestFile::Command &c : test.commands) {
+        TestFile::run(c);
+        if (c.ch=='m') submitted.push_back(c.id);
+        else if (c.ch=='r' && !submitted.empty()) collect();
+    }
+    while (!submitted.empty()) collect();
+    DestroyIndex();
+    return test.expected.size();
+}
+
+static std::map<DocID, unsigned> delivered;
+
+static void OnResult (DocID doc_id, unsigned num_res, const QueryID *query_ids, void *arg)
+{
+    delivered[doc_id]++;
+    Check(doc_id, query_ids, num_res);
+    (*(unsigned*) arg)++;
+}
+
+static unsigned TestCallback ()
+{
+    unsigned calls = 0;
+    SetResultCallback(OnResult, &calls);
+    InitializeIndex();
+    for (const TestFile::Command &c : test.commands) TestFile::run(c);
+    DestroyIndex();
+
+    for (auto &e : test.expected)
+        if (delivered[e.first] != 1) {
+            if (errors++ < 10) printf("  document %u delivered %u times\n", e.first, delivered[e.first]);
+        }
+    if (delivered.size() != test.expected.size()) errors++;
+    return calls;
+}
+
+static unsigned TestBatch ()
+{
+    const unsigned max_docs = 8;
+    DocResult docs[max_docs];
+    unsigned max_ids = 1, pending = 0, got = 0, retries = 0;
+    QueryID *ids = (QueryID*) malloc(max_ids*sizeof(QueryID));
+    InitializeIndex();
+
+    auto collect = [&] () {
+        unsigned n;
+        while (GetAvailResults(docs, max_docs, ids, max_ids, &n) != EC_SUCCESS) {
+            if (n || docs[0].num_res <= max_ids) { errors++; return; }
+            max_ids = docs[0].num_res;
+            ids = (QueryID*) realloc(ids, max_ids*sizeof(QueryID));
+            retries++;
+        }
+        for (unsigned i=0 ; i<n ; i++) Check(docs[i].doc_id, docs[i].query_ids, docs[i].num_res);
+        pending -= n;
+        got += n;
+    };
+
+    for (const TestFile::Command &c : test.commands) {
+        TestFile::run(c);
+        if (c.ch=='m') pending++;
+        else if (c.ch=='r' && pending) collect();
+    }
+    while (pending) collect();
+    DestroyIndex();
+    free(ids);
+
+    if (!retries) {
+        printf("  the id buffer never overflowed\n");
+        errors++;
+    }
+    return got;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 2 || !test.load(argv[1])) {
+        printf("Usage: %s <test file> [order|callback|batch]\n", argv[0]);
+        return 1;
+    }
+
+    const char *modes[] = { "order", "callback", "batch" };
+    int failed = 0;
+    for (const char *mode : modes) {
+        if (argc > 2 && strcmp(argv[2], mode)) continue;
+        fflush(NULL);
+        pid_t pid = fork();
+        if (!pid) {
+            unsigned docs = !strcmp(mode, "order") ? TestOrder() : !strcmp(mode, "callback") ? TestCallback() : TestBatch();
+            printf("%-8s %u documents, %u errors\n", mode, docs, errors);
+            fflush(NULL);
+            _exit(errors ? 1 : 0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+    }
+
+    printf(failed ? "FAILED\n" : "OK\n");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+#include <core.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "testfile.hpp"
+
+/**
+ * Checks SaveIndex/LoadIndex against a test file of test_driver. For a few
+ * split points, one process runs the commands before the split and saves
+ * the index, another loads it into a fresh index and runs the rest; the
+ * results of both must be the expected ones. Then damaged copies of the
+ * snapshot (truncated, bad magic, a match list offset out of range) and a
+ * load into an index in use must all fail with EC_FAIL, leaving the index
+ * usable from scratch. Last, the same round trip over a few query words
+ * ended and restarted within one batch.
+ *
+ * Build with "make tests", then: tests/test_snapshot <test file> [split]
+ */
+
+static TestFile test;
+
+/** Runs commands [from,to), checking the results of the documents; returns the errors. */
+static unsigned Run (unsigned from, unsigned to)
+{
+    unsigned pending = 0, errors = 0;
+    auto collect = [&] () {
+        for ( ; pending ; pending--) {
+            DocID doc_id; unsigned n; QueryID *ids;
+            if (GetNextAvailRes(&doc_id, &n, &ids) != EC_SUCCESS || !test.check(doc_id, ids, n)) errors++;
+            free(ids);
+        }
+    };
+    for (unsigned i=from ; i<to ; i++) {
+        const TestFile::Command &c = test.commands[i];
+        if (TestFile::run(c) != EC_SUCCESS) errors++;
+        if (c.ch=='m') pending++;
+        else if (c.ch=='r') collect();
+    }
+    collect();
+    return errors;
+}
+
+/** Runs `f` in a fresh process, with the statistics of DestroyIndex silenced. Returns whether it succeeded. */
+static bool InChild (const char *what, std::function<bool()> f)
+{
+    fflush(NULL);
+    pid_t pid = fork();
+    if (!pid) {
+        if (!freopen("/dev/null", "w", stdout)) _exit(2);
+        _exit(f() ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && !WEXITSTATUS(status);
+    printf("%-40s %s\n", what, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static std::string ReadFile (const char *path)
+{
+    std::string data;
+    FILE *f = fopen(path, "rb");
+    char buf[1<<16];
+    for (size_t n ; f && (n = fread(buf, 1, sizeof(buf), f)) ; ) data.append(buf, n);
+    if (f) fclose(f);
+    return data;
+}
+
+static void WriteFile (const char *path, const std::string &data)
+{
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        fwrite(data.data(), 1, data.size(), f);
+        fclose(f);
+    }
+}
+
+/**
+ * A test file that ends and restarts the same query words within one
+ * batch, before and after the split it returns in `split`.
+ */
+static TestFile ChurnFile (unsigned &split)
+{
+    TestFile t;
+    auto add = [&] (char ch, unsigned id, int type, int dist, const char *text) {
+        t.commands.push_back(TestFile::Command { ch, id, type, dist, text });
+    };
+    auto match = [&] (DocID doc_id, const char *text, std::vector<QueryID> ids) {
+        add('m', doc_id, 0, 0, text);
+        add('r', doc_id, 0, 0, "");
+        t.expected[doc_id] = ids;
+    };
+    add('s', 1, MT_EDIT_DIST, 1, "abcd");
+    add('s', 2, MT_HAMMING_DIST, 1, "wxyz efgh");
+    add('s', 3, MT_EXACT_MATCH, 0, "ijkl");
+    match(1, "abcd wxyz efgh ijkl", {1, 2, 3});
+    add('e', 1, 0, 0, "");
+    add('e', 2, 0, 0, "");
+    add('e', 3, 0, 0, "");
+    add('s', 4, MT_EDIT_DIST, 0, "abcd");
+    add('s', 5, MT_HAMMING_DIST, 0, "wxyz efgh");
+    add('s', 6, MT_EXACT_MATCH, 0, "ijkl");
+    add('e', 4, 0, 0, "");
+    add('s', 7, MT_EDIT_DIST, 0, "abcd");
+    match(2, "abcd wxyz efgh ijkl", {5, 6, 7});
+    split = t.commands.size();
+    add('s', 8, MT_EDIT_DIST, 1, "abcd mnop");
+    match(3, "abce mnop wxyz efgh ijkl", {5, 6, 8});
+    add('e', 8, 0, 0, "");
+    add('s', 9, MT_EDIT_DIST, 1, "abcd mnop");
+    match(4, "abcf mnop", {9});
+    return t;
+}
+
+/** Saves after `split` commands in one process, loads in another and runs the rest. Returns the failures. */
+static unsigned RoundTrip (const char *path, unsigned split)
+{
+    unsigned n = test.commands.size(), failed = 0;
+    char what[64];
+    sprintf(what, "save after %u commands", split);
+    failed += !InChild(what, [&] () {
+        InitializeIndex();
+        unsigned errors = Run(0, split);
+        bool saved = SaveIndex(path) == EC_SUCCESS;
+        DestroyIndex();
+        return saved && !errors;
+    });
+    sprintf(what, "load and run the other %u", n-split);
+    failed += !InChild(what, [&] () {
+        InitializeIndex();
+        bool loaded = LoadIndex(path) == EC_SUCCESS;
+        unsigned errors = loaded ? Run(split, n) : 0;
+        DestroyIndex();
+        return loaded && !errors;
+    });
+    return failed;
+}
+
+/**
+ * Where the first match list offset lies in a snapshot: past the magic,
+ * the layout sizes, the header values and the dead counts, texts and word
+ * records, each value or array padded to 16 bytes as SaveIndex writes them.
+ */
+static size_t FirstOffsetPos (const std::string &data)
+{
+    auto padded = [] (size_t n) { return (n+15)/16*16; };
+    auto count = [&] (size_t pos) { unsigned long n = 0; memcpy(&n, &data[pos], sizeof(n)); return n; };
+    size_t pos = 16;
+    unsigned layout[2];
+    memcpy(layout, &data[pos+16], sizeof(layout));              /* sizeof(WordText), sizeof(WordRecord) */
+    pos += 16 + padded(count(pos)*sizeof(unsigned));
+    pos += 4*16;                                                /* Engine, batch id, queries, Hamming entries */
+    pos += 16 + padded(count(pos)*sizeof(unsigned));            /* Dead counts */
+    pos += 16 + padded(count(pos)*layout[0]);                   /* Texts */
+    pos += 16 + padded(count(pos)*layout[1]);                   /* Word records */
+    return pos + 16 + sizeof(unsigned);                         /* offsets[1] */
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 2 || !test.load(argv[1])) {
+        printf("Usage: %s <test file> [split]\n", argv[0]);
+        return 1;
+    }
+
+    char path[] = "/tmp/test_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return 1;
+    close(fd);
+    std::string damaged = std::string(path) + ".bad";
+
+    unsigned n = test.commands.size(), failed = 0;
+    std::vector<unsigned> splits;
+    if (argc > 2) splits.push_back(std::min((unsigned) atoi(argv[2]), n));
+    else splits = { n/4, n/2, 3*n/4 };
+
+    for (unsigned split : splits) failed += RoundTrip(path, split);
+
+    /* A refused snapshot must leave the index as InitializeIndex made it */
+    auto refused = [&] (const char *file) {
+        InitializeIndex();
+        bool refused = LoadIndex(file) == EC_FAIL;
+        unsigned errors = Run(0, n);
+        DestroyIndex();
+        return refused && !errors;
+    };
+    std::string data = ReadFile(path);
+    WriteFile(damaged.c_str(), data.substr(0, data.size()/2));
+    failed += !InChild("truncated snapshot refused", [&] () { return refused(damaged.c_str()); });
+
+    std::string bad = data;
+    bad[0] ^= 1;
+    WriteFile(damaged.c_str(), bad);
+    failed += !InChild("bad magic refused", [&] () { return refused(damaged.c_str()); });
+
+    bad = data;
+    unsigned offset = 0x7fffffff;
+    memcpy(&bad[FirstOffsetPos(bad)], &offset, sizeof(offset));
+    WriteFile(damaged.c_str(), bad);
+    failed += !InChild("match list offset out of range refused", [&] () { return refused(damaged.c_str()); });
+
+    failed += !InChild("missing snapshot refused", [&] () { return refused("/nonexistent/snapshot"); });
+
+    failed += !InChild("load into an index in use refused", [&] () {
+        InitializeIndex();
+        unsigned errors = Run(0, 1);
+        bool refused = LoadIndex(path) == EC_FAIL;
+        errors += Run(1, n);
+        DestroyIndex();
+        return refused && !errors;
+    });
+
+    /* Query words ended and restarted within a batch, around the split */
+    unsigned split;
+    test = ChurnFile(split);
+    printf("churn:\n");
+    failed += RoundTrip(path, split);
+
+    unlink(path);
+    unlink(damaged.c_str());
+    printf(failed ? "FAILED\n" : "OK\n");
+    return failed ? 1 : 0;
+}
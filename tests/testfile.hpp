@@ -0,0 +1,75 @@
+#ifndef TEST_FILE_H
+#define TEST_FILE_H
+
+#include <core.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+/**
+ * A test file in the format of test_driver, read up front, so that the
+ * expected results of a document are known before it is matched.
+ */
+struct TestFile
+{
+    struct Command {
+        char            ch;             ///< 's', 'e', 'm' or 'r'.
+        unsigned        id;
+        int             type, dist;     ///< For 's' only.
+        std::string     text;           ///< Query words of 's', document of 'm'.
+    };
+
+    std::vector<Command>                            commands;
+    std::map<DocID, std::vector<QueryID> >          expected;   ///< Sorted query ids of every document.
+
+    bool load (const char *path) {
+        static char text[MAX_DOC_LENGTH];
+        FILE *f = fopen(path, "rt");
+        if (!f) return false;
+
+        Command c;
+        while (fscanf(f, "%c %u ", &c.ch, &c.id) == 2) {
+            c.type = c.dist = 0;
+            c.text.clear();
+            if (c.ch=='s') {
+                if (fscanf(f, "%d %d %*d %[^\n\r] ", &c.type, &c.dist, text) != 3) break;
+                c.text = text;
+            }
+            else if (c.ch=='m') {
+                if (fscanf(f, "%*u %[^\n\r] ", text) != 1) break;
+                c.text = text;
+            }
+            else if (c.ch=='r') {
+                unsigned n, qid;
+                if (fscanf(f, "%u ", &n) != 1) break;
+                std::vector<QueryID> &ids = expected[c.id];
+                for (unsigned i=0 ; i<n && fscanf(f, "%u ", &qid)==1 ; i++) ids.push_back(qid);
+                std::sort(ids.begin(), ids.end());
+            }
+            commands.push_back(c);
+        }
+        fclose(f);
+        return !commands.empty();
+    }
+
+    /** Issues command `c` to the index; 'r' is left to the caller. */
+    static ErrorCode run (const Command &c) {
+        if (c.ch=='s') return StartQuery(c.id, c.text.c_str(), (MatchType) c.type, c.dist);
+        if (c.ch=='e') return EndQuery(c.id);
+        if (c.ch=='m') return MatchDocument(c.id, c.text.c_str());
+        return EC_SUCCESS;
+    }
+
+    /** Whether `ids` (in any order) are the expected results of `doc_id`. */
+    bool check (DocID doc_id, const QueryID *ids, unsigned n) const {
+        std::vector<QueryID> got(ids, ids+n);
+        std::sort(got.begin(), got.end());
+        std::map<DocID, std::vector<QueryID> >::const_iterator e = expected.find(doc_id);
+        return e != expected.end() && e->second == got;
+    }
+};
+
+#endif